@@ -0,0 +1,495 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+
+#include "HostSim.h"
+#include "HostPort.h"
+#include "W5100Model.h"
+
+//Simulated ATmega2560: register file, model clock, TIMER1, TIMER3 compare and INT4 interrupts, idle sleep, SPM/RWW flash and EEPROM
+
+volatile uint8_t DDRB, PORTB, DDRG, PORTG;
+volatile uint8_t SPCR, SPSR, SPDR;
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1;
+volatile uint16_t OCR1A, OCR3A;
+volatile uint8_t TCCR3A, TCCR3B, TIMSK3;
+volatile uint8_t MCUCR, MCUSR, SREG;
+volatile uint8_t DDRE, PORTE, EICRB, EIMSK, SMCR;
+
+uint64_t host_time_ns;
+uint8_t host_int_wired = 1;
+volatile uint16_t host_boot_mailbox;
+volatile uint8_t host_boot_handoff[64];
+HostStats host_stats;
+uint8_t host_flash[HOST_FLASH_SIZE];
+
+static jmp_buf run_env;
+static uint64_t run_limit_ns;
+static int running;				//inside host_run_bootloader, outside it the bench is playing the application
+
+static uint64_t timer1_next_ns;		//0 while TIMER1 is stopped
+static uint8_t timer1_pending;		//compare match flag set while interrupts were disabled
+static uint8_t in_interrupt;
+static uint64_t timer3_checked_ns;	//compare matches up to here have been looked for
+static uint8_t timer3_pending;
+
+static uint8_t spm_buffer[SPM_PAGESIZE];
+static uint8_t spm_loaded[SPM_PAGESIZE / 2];	//words of the temporary buffer written since it was last cleared
+static uint64_t spm_busy_until;
+static uint8_t rww_busy;
+static uint64_t eeprom_busy_until;
+
+static uint8_t spi_reply;
+
+ISR(TIMER1_COMPA_vect);
+ISR(TIMER3_COMPA_vect);
+ISR(INT4_vect);
+
+void host_violation(const char *message)
+{
+	if(host_stats.violations++ < 8)
+	{
+		fprintf(stderr, "hostsim: %s at %.3f ms\n", message, host_time_ns / 1e6);
+	}
+}
+
+static void timer1_update(void)
+{
+	//TIMER1 in CTC mode, the boot loader only uses the OCR1A compare match interrupt
+	uint8_t clock_select = TCCR1B & ((1<<CS12) | (1<<CS11) | (1<<CS10));
+	if(clock_select != ((1<<CS12) | (1<<CS10)) || OCR1A == 0)
+	{
+		timer1_next_ns = 0;
+		timer1_pending = 0;
+		return;
+	}
+
+	uint64_t period_ns = (uint64_t)(OCR1A + 1) * 1024 * 1000 / 16;	//clk/1024 at 16MHz
+	if(timer1_next_ns == 0)
+	{
+		timer1_next_ns = host_time_ns + period_ns;
+	}
+	while(host_time_ns >= timer1_next_ns)
+	{
+		timer1_pending = 1;
+		timer1_next_ns += period_ns;
+	}
+
+	if(timer1_pending && (TIMSK1 & (1<<OCIE1A)) && (SREG & 0x80) && !in_interrupt)
+	{
+		timer1_pending = 0;
+		in_interrupt = 1;
+		host_stats.interrupts++;
+		TIMER1_COMPA_vect();
+		in_interrupt = 0;
+	}
+}
+
+volatile uint16_t *host_timer3_register(void)
+{
+	//TIMER3 free running in normal mode, only the clk/256 prescaler used by the boot loader is modelled
+	static volatile uint16_t count;
+	if((TCCR3B & ((1<<CS32) | (1<<CS31) | (1<<CS30))) != (1<<CS32))
+	{
+		count = 0;
+	}
+	else
+	{
+		count = (uint16_t)(host_time_ns * 16 / 256 / 1000);
+	}
+	return &count;
+}
+
+#define TIMER3_TICK_NS 16000ULL		//clk/256 at 16MHz
+
+static uint64_t timer3_next_ns(void)
+{
+	//time of the next OCR3A compare match, 0 while the interrupt is off
+	if((TCCR3B & ((1<<CS32) | (1<<CS31) | (1<<CS30))) != (1<<CS32) || !(TIMSK3 & (1<<OCIE3A)))
+	{
+		return 0;
+	}
+	uint64_t tick = timer3_checked_ns / TIMER3_TICK_NS;
+	uint16_t distance = OCR3A - (uint16_t)tick;
+	return (tick + (distance ? distance : 0x10000)) * TIMER3_TICK_NS;
+}
+
+static void timer3_update(void)
+{
+	//the OCR3A compare match interrupt, the counter runs on so a match that has been passed is next due after it wraps
+	uint64_t next = timer3_next_ns();
+	if(next == 0)
+	{
+		timer3_checked_ns = host_time_ns;
+		timer3_pending = 0;
+		return;
+	}
+	if(host_time_ns >= next)
+	{
+		timer3_pending = 1;
+	}
+	timer3_checked_ns = host_time_ns;
+
+	if(timer3_pending && (SREG & 0x80) && !in_interrupt)
+	{
+		timer3_pending = 0;
+		in_interrupt = 1;
+		host_stats.interrupts++;
+		TIMER3_COMPA_vect();
+		in_interrupt = 0;
+	}
+}
+
+uint8_t host_pine(void)
+{
+	return host_int_wired && w5100_int_asserted() ? 0 : (1<<PE4);
+}
+
+static void int4_update(void)
+{
+	//INT4 is the W5100 /INT line, the boot loader sets it to trigger on a low level
+	//so the ISR runs for as long as the line is low and the interrupt is enabled
+	if(!(host_pine() & (1<<PE4)) && (EIMSK & (1<<INT4)) && (EICRB & ((1<<ISC41) | (1<<ISC40))) == 0 &&
+	   (SREG & 0x80) && !in_interrupt)
+	{
+		in_interrupt = 1;
+		host_stats.interrupts++;
+		INT4_vect();
+		in_interrupt = 0;
+	}
+}
+
+void host_advance_ns(uint64_t ns)
+{
+	host_time_ns += ns;
+	w5100_model_advance(host_time_ns);
+	timer1_update();
+	timer3_update();
+	int4_update();
+
+	if(running && host_time_ns > run_limit_ns)
+	{
+		longjmp(run_env, 2);
+	}
+}
+
+void host_delay_us(double us)
+{
+	host_advance_ns((uint64_t)(us * 1000.0));
+}
+
+void host_loop_pass(void)
+{
+	host_advance_ns(HOST_LOOP_PASS_NS);
+}
+
+void host_sleep_cpu(void)
+{
+	//idle sleep, the clock jumps from one network event or timer tick to the next until an ISR runs
+	if(!(SMCR & (1<<SE)))
+	{
+		return;
+	}
+	uint64_t interrupts = host_stats.interrupts;
+	int4_update();		//a level interrupt that is already pending wakes straight away
+	while(host_stats.interrupts == interrupts)
+	{
+		uint64_t next = w5100_model_next_event();
+		if(timer1_next_ns && timer1_next_ns < next)
+		{
+			next = timer1_next_ns;
+		}
+		if(timer3_next_ns() && timer3_next_ns() < next)
+		{
+			next = timer3_next_ns();
+		}
+		if(next > run_limit_ns)
+		{
+			next = run_limit_ns + 1;
+		}
+		uint64_t step = next > host_time_ns ? next - host_time_ns : 1;
+		host_stats.sleep_ns += step;
+		host_advance_ns(step);
+	}
+}
+
+void host_jump_application(void)
+{
+	longjmp(run_env, 1);
+}
+
+int host_run_bootloader(uint64_t time_limit_ns)
+{
+	run_limit_ns = host_time_ns + time_limit_ns;
+	SREG = 0;
+	MCUCR = 0;
+	EIMSK = 0;
+	EICRB = 0;
+	SMCR = 0;
+	timer1_next_ns = 0;
+	timer1_pending = 0;
+	TIMSK3 = 0;
+	timer3_pending = 0;
+
+	int exit_reason = setjmp(run_env);
+	if(exit_reason == 0)
+	{
+		running = 1;
+		boot_mailbox_read();
+		bootloader_main();
+	}
+	running = 0;
+	return exit_reason == 1;
+}
+
+//---------------------------------------------------------------------------------------------
+//SPI, each byte goes straight to the W5100 model
+
+void host_spi_select(void)
+{
+	host_stats.cs_cycles++;
+	w5100_spi_select();
+}
+
+void host_spi_deselect(void)
+{
+	if(w5100_spi_deselect())
+	{
+		host_stats.spi_frames++;
+	}
+}
+
+void host_spi_write(unsigned char data)
+{
+	if(!(SPCR & (1<<SPE)))
+	{
+		host_violation("SPI used while disabled");
+	}
+	host_stats.spi_bytes++;
+	host_advance_ns(HOST_SPI_BYTE_NS);
+	spi_reply = w5100_spi_byte(data);
+}
+
+unsigned char host_spi_read(void)
+{
+	return spi_reply;
+}
+
+//---------------------------------------------------------------------------------------------
+//Flash and SPM, page erase/write run in the background for HOST_SPM_PROGRAM_NS like the RWW section does
+
+uint8_t host_flash_read_byte(uint32_t address)
+{
+	if(address < HOST_BOOT_START && rww_busy)
+	{
+		host_violation("RWW section read while busy");
+		return 0xFF;
+	}
+	host_stats.flash_reads++;
+	return host_flash[address % HOST_FLASH_SIZE];
+}
+
+void host_flash_read_run(uint32_t address, uint8_t *buf, uint16_t length)
+{
+	//the boot loader's ELPM Z+ loop, RAMPZ is loaded once so the run must stay inside one 64KB bank
+	if(length == 0 || (address >> 16) != ((address + length - 1) >> 16))
+	{
+		host_violation("ELPM run crosses a 64KB boundary or is empty");
+	}
+	for(uint16_t i = 0; i < length; i++)
+	{
+		buf[i] = host_flash_read_byte(address + i);
+	}
+}
+
+static void spm_clear_buffer(void)
+{
+	memset(spm_buffer, 0xFF, sizeof(spm_buffer));
+	memset(spm_loaded, 0, sizeof(spm_loaded));
+}
+
+static int spm_loading(void)
+{
+	for(uint16_t i = 0; i < sizeof(spm_loaded); i++)
+	{
+		if(spm_loaded[i])
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int spm_check(uint32_t address)
+{
+	if(host_spm_busy())
+	{
+		host_violation("SPM issued while a previous SPM operation is busy");
+		return 0;
+	}
+	if(host_time_ns < eeprom_busy_until)
+	{
+		host_violation("SPM issued during an EEPROM write");
+		return 0;
+	}
+	if(address >= HOST_BOOT_START)
+	{
+		host_violation("SPM into the boot section");
+		return 0;
+	}
+	return 1;
+}
+
+void host_spm_page_erase(uint32_t address)
+{
+	if(!spm_check(address))
+	{
+		return;
+	}
+	memset(&host_flash[address & ~(uint32_t)(SPM_PAGESIZE - 1)], 0xFF, SPM_PAGESIZE);
+	host_stats.flash_erases++;
+	spm_busy_until = host_time_ns + HOST_SPM_PROGRAM_NS;
+	rww_busy = 1;
+}
+
+void host_spm_page_fill(uint32_t address, uint16_t data)
+{
+	if(host_spm_busy())
+	{
+		host_violation("page buffer filled while SPM is busy");
+		return;
+	}
+	if(host_time_ns < eeprom_busy_until)
+	{
+		host_violation("page buffer filled during an EEPROM write");
+	}
+	if(spm_loaded[(address & (SPM_PAGESIZE - 2)) / 2]++)
+	{
+		host_violation("page buffer word written twice without clearing the buffer");
+	}
+	spm_buffer[address & (SPM_PAGESIZE - 2)] = data & 0xFF;
+	spm_buffer[(address & (SPM_PAGESIZE - 2)) + 1] = data >> 8;
+}
+
+void host_spm_page_write(uint32_t address)
+{
+	if(!spm_check(address))
+	{
+		return;
+	}
+	//programming can only clear bits, a page that was not erased first keeps its old ones
+	uint8_t *page = &host_flash[address & ~(uint32_t)(SPM_PAGESIZE - 1)];
+	for(uint16_t i = 0; i < SPM_PAGESIZE; i++)
+	{
+		page[i] &= spm_buffer[i];
+	}
+	spm_clear_buffer();		//the temporary buffer is cleared by a page write
+	host_stats.flash_writes++;
+	spm_busy_until = host_time_ns + HOST_SPM_PROGRAM_NS;
+	rww_busy = 1;
+}
+
+uint8_t host_spm_busy(void)
+{
+	return host_time_ns < spm_busy_until;
+}
+
+void host_spm_busy_wait(void)
+{
+	if(host_spm_busy())
+	{
+		uint64_t wait = spm_busy_until - host_time_ns;
+		host_stats.spm_wait_ns += wait;
+		host_advance_ns(wait);
+	}
+}
+
+uint8_t host_rww_busy(void)
+{
+	return rww_busy;
+}
+
+void host_rww_enable(void)
+{
+	if(!host_spm_busy())
+	{
+		rww_busy = 0;
+		spm_clear_buffer();		//RWWSRE aborts a page buffer load, the data loaded is lost
+	}
+}
+
+//---------------------------------------------------------------------------------------------
+//EEPROM, EEMEM variables are ordinary globals and writes keep the EEPROM busy for HOST_EEPROM_WRITE_NS
+
+void eeprom_busy_wait(void)
+{
+	if(host_time_ns < eeprom_busy_until)
+	{
+		host_advance_ns(eeprom_busy_until - host_time_ns);
+	}
+}
+
+uint8_t eeprom_is_ready(void)
+{
+	return host_time_ns >= eeprom_busy_until;
+}
+
+uint8_t eeprom_read_byte(const uint8_t *address)
+{
+	eeprom_busy_wait();
+	return *address;
+}
+
+void eeprom_write_byte(uint8_t *address, uint8_t value)
+{
+	eeprom_busy_wait();
+	if(host_spm_busy())
+	{
+		host_violation("EEPROM written while SPM is busy");
+	}
+	if(spm_loading())
+	{
+		host_violation("EEPROM written while the page buffer is loaded");
+		spm_clear_buffer();		//all data loaded is lost
+	}
+	*address = value;
+	host_stats.eeprom_writes++;
+	eeprom_busy_until = host_time_ns + HOST_EEPROM_WRITE_NS;
+}
+
+void eeprom_update_byte(uint8_t *address, uint8_t value)
+{
+	if(eeprom_read_byte(address) != value)
+	{
+		eeprom_write_byte(address, value);
+	}
+}
+
+void eeprom_read_block(void *destination, const void *source, size_t length)
+{
+	eeprom_busy_wait();
+	memcpy(destination, source, length);
+}
+
+void eeprom_update_block(const void *source, void *destination, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		eeprom_update_byte((uint8_t *)destination + i, ((const uint8_t *)source)[i]);
+	}
+}
+
+void eeprom_write_block(const void *source, void *destination, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		eeprom_write_byte((uint8_t *)destination + i, ((const uint8_t *)source)[i]);
+	}
+}
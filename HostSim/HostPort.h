@@ -0,0 +1,33 @@
+#ifndef HOSTPORT_H_
+#define HOSTPORT_H_
+
+//Forced include (-include HostPort.h) for the boot loader sources in the host build
+//routes the hardware hooks in WiznetW5100.c and W5100TCPBootloader.c to the simulation in HostAvr.c
+
+#include <stdint.h>
+
+void host_spi_select(void);
+void host_spi_deselect(void);
+void host_spi_write(unsigned char data);
+unsigned char host_spi_read(void);
+void host_jump_application(void);
+void host_loop_pass(void);
+extern volatile uint16_t host_boot_mailbox;
+extern volatile uint8_t host_boot_handoff[64];
+void host_flash_read_run(uint32_t address, uint8_t *buf, uint16_t length);
+
+#define WIZNET_SELECT()			host_spi_select()
+#define WIZNET_DESELECT()		host_spi_deselect()
+#define WIZNET_SPI_WRITE(data)	host_spi_write(data)
+#define WIZNET_SPI_WAIT()		((void)0)		//the model completes each byte inside host_spi_write
+#define WIZNET_SPI_READ()		host_spi_read()
+
+#define BOOT_JUMP_APPLICATION() host_jump_application()
+#define BOOT_LOOP_PASS()		host_loop_pass()
+#define BOOT_MAILBOX			host_boot_mailbox
+#define BOOT_HANDOFF_BLOCK		((volatile BootHandoff *)host_boot_handoff)
+#define BOOT_INIT3						//host_run_bootloader calls boot_mailbox_read before main
+#define BOOT_FLASH_READ_RUN(address, buf, length) host_flash_read_run(address, buf, length)
+#define BOOT_API_TABLE					//the bench calls boot_api_stage_page and boot_api_stage_commit directly
+
+#endif /* HOSTPORT_H_ */
@@ -0,0 +1,62 @@
+#ifndef HOSTSIM_H_
+#define HOSTSIM_H_
+
+//Simulated ATmega2560 for running the boot loader on a Linux host
+//time is modelled rather than measured: SPI bytes, delays, SPM and EEPROM programming advance the clock,
+//the CPU time spent between them is not counted
+
+#include <stdint.h>
+
+#define HOST_FLASH_SIZE 0x40000UL			//256KB ATmega2560 flash
+#ifdef BOOT_START
+#define HOST_BOOT_START BOOT_START			//a build for another boot section size
+#else
+#define HOST_BOOT_START 0x3E000UL			//boot section (BOOTSZ 4096 words), NRWW
+#endif
+#define HOST_SPI_BYTE_NS 1000UL				//8 bits at 8MHz SPI2X
+#define HOST_SPM_PROGRAM_NS 4000000UL		//page erase or page write, datasheet tWD_FLASH 3.7-4.5ms
+#define HOST_EEPROM_WRITE_NS 3400000UL		//EEPROM byte write, datasheet tWD_EEPROM 3.3ms
+#define HOST_LOOP_PASS_NS 2000UL			//a pass of the boot loader's main loop without SPI, about 32 cycles
+
+typedef struct
+{
+	uint64_t spi_bytes;			//bytes clocked over SPI
+	uint64_t spi_frames;		//complete 4 byte W5100 frames
+	uint64_t cs_cycles;			//chip select assertions
+	uint64_t flash_erases;
+	uint64_t flash_writes;
+	uint64_t flash_reads;		//bytes read from the RWW section
+	uint64_t spm_wait_ns;		//time spent in boot_spm_busy_wait
+	uint64_t eeprom_writes;
+	uint64_t sleep_ns;			//time spent in sleep_cpu
+	uint64_t interrupts;		//ISRs run
+	uint64_t violations;		//hardware rules broken (SPM while busy, RWW read while busy, ...)
+} HostStats;
+
+extern uint64_t host_time_ns;
+extern HostStats host_stats;
+extern uint8_t host_flash[HOST_FLASH_SIZE];
+
+//0 for a board without the INT jumper, the W5100 /INT line is then not connected to PE4 (INT4)
+extern uint8_t host_int_wired;
+
+//advance the model clock, delivering network events and the timer interrupts that fall due
+void host_advance_ns(uint64_t ns);
+
+//record a broken hardware rule, the message is printed the first few times
+void host_violation(const char *message);
+
+//run the boot loader from reset until it jumps to the application (returns 1)
+//or the modelled time passes time_limit_ns (returns 0)
+int host_run_bootloader(uint64_t time_limit_ns);
+
+//the last 2 bytes of SRAM, where an application leaves a boot request before resetting
+extern volatile uint16_t host_boot_mailbox;
+//the 64 bytes below the end of SRAM, where the boot loader leaves the handoff block (BootHandoff.h)
+extern volatile uint8_t host_boot_handoff[64];
+
+//main() of W5100TCPBootloader.c, renamed by the host build, and its .init3 code
+int bootloader_main(void);
+void boot_mailbox_read(void);
+
+#endif /* HOSTSIM_H_ */
@@ -0,0 +1,796 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "HostSim.h"
+#include "W5100Model.h"
+#include "WiznetW5100.h"
+#include "BootApi.h"
+#include "BootHandoff.h"
+#include "BootConfig.h"
+#include "BootEeprom.h"
+#include <avr/io.h>
+
+//Benchmark of complete boot loader update sessions against the W5100 model
+//runs PROG -> HEADER -> PROGRAMMING -> VERIFY -> OK for each image size and reports SPI frames,
+//chip select cycles and modelled time, all of which are deterministic so they can be compared across changes
+//Ctl/KB is the SPI frames that did not carry a byte of the session's TCP payload (register access, UDP headers
+//and the reads and writes of buffer pointers), per KB of image
+//
+//session modes:
+//  prog   full image, verified by the echo of every page
+//  delta  DLTA, the device already holds an older image that differs in 1 page out of 32,
+//         only the changed pages are sent and the result is verified with page digests
+//  crc    full image like prog, but the header asks for one CRC32 of the whole image in place of the echo
+//  sparse PROG with segments, the image is mostly erased space and only its non-erased page runs are sent,
+//         the device still holds an older full image, so the gaps have to be erased, verified by the image CRC
+//  cut    prog, but the first connection closes after half of the page count header, the device has to drop the
+//         two bytes and listen again, then the peer connects again and sends the image
+//  noint  prog on a board without the INT jumper, the device only finds out about network events from its timers
+//  warm   prog with WarmHandoff set, the application is handed the W5100 still configured, checks the chip's
+//         settings and closed sockets and that SPI is still enabled when the application starts
+//  stage  the running application stages the image through the boot loader's API (BootApi.h) over a different
+//         older one and resets, reports the time from reset to the new application, which is all the downtime,
+//         and the time the application spent staging, only for sizes that fit the staging area. Before the reset
+//         the rest of the API is checked (page programming and read back, the network settings, W5100 access)
+//  dump   DUMP, the application has asked for the boot loader and the host reads the image back out of the flash,
+//         after a first connection that asks for a range past the end of the flash and has to be refused,
+//         reports the time from the range request to the last byte and the rate against the SPI limit. The host
+//         then closes the connection and the device starts the application again after the 10 second timeout
+//  idle   the application has asked for the boot loader (SRAM mailbox) but no host connects, the device starts
+//         the application again after the 10 second timeout, reports when it was listening, the SPI traffic
+//         and the share of the time spent asleep while waiting (run once, not per size)
+//  boot   a programmed application and no boot request, reports the time from reset to the application
+//         (run once, not per size)
+//
+//every mode also checks the handoff block the boot loader leaves for the application (BootHandoff.h)
+//
+//-s asks the device for its performance counters (STAT) before sending OK and prints where its time went
+//
+//usage: W5100Bench [-r rtt_us] [-l link_mbit] [-m mode] [-s] [image size in KB ...]
+
+#define SESSION_TIME_LIMIT_NS 120000000000ULL	//120 modelled seconds
+
+enum {MODE_PROG, MODE_DELTA, MODE_CRC, MODE_SPARSE, MODE_CUT, MODE_NOINT, MODE_WARM, MODE_STAGE, MODE_DUMP, MODE_IDLE,
+	  MODE_BOOT, MODE_COUNT};
+static const char *mode_names[MODE_COUNT] = {"prog", "delta", "crc", "sparse", "cut", "noint", "warm", "stage", "dump", "idle",
+											 "boot"};
+static const char *mode_commands[MODE_COUNT] = {"PROG", "DLTA", "PROG", "PROG", "PROG", "PROG", "PROG", "", "DUMP", "", ""};
+static const uint8_t mode_flags[MODE_COUNT] = {0x00, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};	//top byte of the page count
+
+extern BootEeprom Eeprom;	//the boot loader's EEPROM, EEMEM is an ordinary global here
+static const uint8_t device_ip[4] = {10, 0, 0, 75};	//DeviceIPAddress in the boot loader's EEPROM
+
+#define STAT_RECORD_LENGTH 52
+static int want_stats;
+
+typedef struct
+{
+	int mode;
+	const uint8_t *image;
+	uint32_t pages;
+
+	enum {PEER_WAIT_VERSION, PEER_WAIT_ECHO, PEER_WAIT_DIGESTS, PEER_WAIT_VERIFY_DIGESTS, PEER_WAIT_IMAGE_CRC,
+		  PEER_WAIT_STAT, PEER_DROPPED, PEER_WAIT_DUMP, PEER_DONE} state;
+	uint8_t reply[8];
+	uint32_t reply_length;
+	uint32_t echo_received;
+	uint32_t echo_errors;
+	uint8_t *digests;
+	uint32_t pages_sent;
+
+	uint32_t connections;
+	uint64_t drop_ns;
+	uint64_t reconnect_ns;
+	uint64_t dump_frames;		//SPI frames when the last byte of the dump arrived
+
+	uint8_t stat[STAT_RECORD_LENGTH];
+	uint32_t stat_length;
+
+	uint32_t bytes_sent;
+	uint32_t bytes_received;
+	uint64_t connect_ns;
+	uint64_t header_ns;
+	uint64_t first_echo_ns;
+	uint64_t last_echo_ns;
+} Session;
+
+static uint32_t crc32(const uint8_t *data, uint32_t length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	while(length--)
+	{
+		crc ^= *data++;
+		for(int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static int digest_matches(const Session *session, uint32_t page)
+{
+	const uint8_t *d = &session->digests[page * 4];
+	uint32_t digest = d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+	return digest == crc32(&session->image[page * 256], 256);
+}
+
+static void send_bytes(Session *session, int socket, const void *data, uint32_t length)
+{
+	w5100_peer_send(socket, data, length);
+	session->bytes_sent += length;
+}
+
+static void session_connected(void *context, int socket)
+{
+	Session *session = context;
+	if(session->mode == MODE_DUMP && session->state == PEER_DONE)
+	{
+		return;		//the device listens again after the dump, the peer has nothing more to ask
+	}
+	if(session->connections++ == 0)
+	{
+		session->connect_ns = host_time_ns;
+	}
+	else
+	{
+		session->reconnect_ns = host_time_ns;
+	}
+	session->state = PEER_WAIT_VERSION;
+	session->reply_length = 0;
+	send_bytes(session, socket, mode_commands[session->mode], 4);
+	if(session->mode == MODE_DUMP && session->connections == 1)
+	{
+		//first a range that runs past the end of the flash, the device must drop the connection and listen again
+		uint8_t range[8] = {0x00, 0xFF, 0x03, 0x00, 0x00, 0x02, 0x00, 0x00};
+		send_bytes(session, socket, range, 8);
+	}
+	else if(session->mode == MODE_DUMP)
+	{
+		//then the whole image, from address 0
+		uint32_t length = session->pages * 256;
+		uint8_t range[8] = {0, 0, 0, 0, length & 0xFF, (length >> 8) & 0xFF, (length >> 16) & 0xFF, length >> 24};
+		send_bytes(session, socket, range, 8);
+	}
+}
+
+static void send_delta_records(Session *session, int socket)
+{
+	//a 2 byte page index and the page, for each page whose digest differs, then the 0xFFFF end marker
+	for(uint32_t page = 0; page < session->pages; page++)
+	{
+		if(!digest_matches(session, page))
+		{
+			uint8_t index[2] = {page & 0xFF, page >> 8};
+			send_bytes(session, socket, index, 2);
+			send_bytes(session, socket, &session->image[page * 256], 256);
+			session->pages_sent++;
+		}
+	}
+	send_bytes(session, socket, "\xFF\xFF", 2);
+}
+
+static int page_erased(const Session *session, uint32_t page)
+{
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		if(session->image[page * 256 + i] != 0xFF)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void send_segments(Session *session, int socket)
+{
+	//a descriptor and the pages of every run of pages that are not erased
+	uint32_t count = 0;
+	for(uint32_t page = 0; page < session->pages; page++)
+	{
+		if(!page_erased(session, page) && (page == 0 || page_erased(session, page - 1)))
+		{
+			count++;
+		}
+	}
+	uint8_t header[4] = {count & 0xFF, (count >> 8) & 0xFF, (count >> 16) & 0xFF, mode_flags[session->mode]};
+	send_bytes(session, socket, header, 4);
+
+	uint32_t page = 0;
+	while(page < session->pages)
+	{
+		if(page_erased(session, page))
+		{
+			page++;
+			continue;
+		}
+		uint32_t start = page;
+		while(page < session->pages && !page_erased(session, page))
+		{
+			page++;
+		}
+		uint8_t segment[4] = {start & 0xFF, start >> 8, (page - start) & 0xFF, (page - start) >> 8};
+		send_bytes(session, socket, segment, 4);
+		send_bytes(session, socket, &session->image[start * 256], (page - start) * 256);
+		session->pages_sent += page - start;
+	}
+}
+
+static void send_ok(Session *session, int socket)
+{
+	//the image is verified, ask for the counters first if they are wanted
+	if(want_stats)
+	{
+		send_bytes(session, socket, "STAT", 4);
+		session->state = PEER_WAIT_STAT;
+		return;
+	}
+	send_bytes(session, socket, "OK", 2);
+	session->state = PEER_DONE;
+}
+
+static uint32_t stat_counter(const Session *session, int index)
+{
+	const uint8_t *d = &session->stat[4 + index * 4];
+	return d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+static void print_stats(const Session *session)
+{
+	//the device's own view of the session: its counters and where the time of its main loop went
+	if(session->stat_length != STAT_RECORD_LENGTH || session->stat[0] != 1)
+	{
+		return;
+	}
+	double tick_ms = session->stat[2] / 1e3;
+	printf("       device: %u SPI frames, %u bytes in, %u bytes out, %u pages programmed, %u erased\n",
+		   stat_counter(session, 0), stat_counter(session, 1), stat_counter(session, 2),
+		   stat_counter(session, 3), stat_counter(session, 4));
+	printf("       run %.1f ms: waiting for rx %.1f, tx %.1f, flash %.1f ms; erase %.1f, write %.1f, read back %.1f ms\n",
+		   stat_counter(session, 5) * tick_ms, stat_counter(session, 6) * tick_ms, stat_counter(session, 7) * tick_ms,
+		   stat_counter(session, 8) * tick_ms, stat_counter(session, 9) * tick_ms, stat_counter(session, 10) * tick_ms,
+		   stat_counter(session, 11) * tick_ms);
+}
+
+static void session_received(void *context, int socket, const uint8_t *data, uint32_t length)
+{
+	Session *session = context;
+	session->bytes_received += length;
+
+	for(uint32_t i = 0; i < length; i++)
+	{
+		switch(session->state)
+		{
+			case PEER_WAIT_VERSION:
+			{
+				session->reply[session->reply_length++] = data[i];
+				if(session->reply_length == 6)
+				{
+					if(memcmp(session->reply, "V1.0\r\n", 6) != 0)
+					{
+						session->state = PEER_DONE;
+						break;
+					}
+					if(session->mode == MODE_DUMP)
+					{
+						session->header_ns = host_time_ns;
+						session->state = PEER_WAIT_DUMP;
+						break;
+					}
+					if(session->mode == MODE_CUT && session->connections == 1)
+					{
+						//half of the page count header, then the connection closes
+						uint8_t header[2] = {session->pages & 0xFF, (session->pages >> 8) & 0xFF};
+						send_bytes(session, socket, header, 2);
+						w5100_peer_close(socket);
+						session->drop_ns = host_time_ns;
+						session->state = PEER_DROPPED;
+						break;
+					}
+					if(session->mode == MODE_SPARSE)
+					{
+						send_segments(session, socket);
+						session->header_ns = host_time_ns;
+						session->state = PEER_WAIT_IMAGE_CRC;
+						break;
+					}
+					//page count header followed by the whole image, the model sends it as the window allows
+					uint8_t header[4] = {session->pages & 0xFF, (session->pages >> 8) & 0xFF,
+										 (session->pages >> 16) & 0xFF, mode_flags[session->mode]};
+					send_bytes(session, socket, header, 4);
+					session->header_ns = host_time_ns;
+					if(session->mode == MODE_DELTA)
+					{
+						session->state = PEER_WAIT_DIGESTS;
+					}
+					else
+					{
+						send_bytes(session, socket, session->image, session->pages * 256);
+						session->pages_sent = session->pages;
+						session->state = session->mode == MODE_CRC ? PEER_WAIT_IMAGE_CRC : PEER_WAIT_ECHO;
+					}
+				}
+				break;
+			}
+			case PEER_WAIT_DIGESTS:
+			case PEER_WAIT_VERIFY_DIGESTS:
+			{
+				if(session->state == PEER_WAIT_VERIFY_DIGESTS && session->echo_received == 0)
+				{
+					session->first_echo_ns = host_time_ns;
+				}
+				session->digests[session->echo_received++] = data[i];
+				if(session->echo_received < session->pages * 4)
+				{
+					break;
+				}
+				session->echo_received = 0;
+				if(session->state == PEER_WAIT_DIGESTS)
+				{
+					send_delta_records(session, socket);
+					session->state = PEER_WAIT_VERIFY_DIGESTS;
+					break;
+				}
+				for(uint32_t page = 0; page < session->pages; page++)
+				{
+					if(!digest_matches(session, page))
+					{
+						session->echo_errors++;
+					}
+				}
+				session->last_echo_ns = host_time_ns;
+				session->state = PEER_DONE;
+				if(session->echo_errors == 0)
+				{
+					send_ok(session, socket);
+				}
+				break;
+			}
+			case PEER_WAIT_IMAGE_CRC:
+			{
+				if(session->echo_received == 0)
+				{
+					session->first_echo_ns = host_time_ns;
+				}
+				session->reply[session->echo_received++] = data[i];
+				if(session->echo_received == 4)
+				{
+					const uint8_t *d = session->reply;
+					uint32_t digest = d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+					session->last_echo_ns = host_time_ns;
+					session->state = PEER_DONE;
+					if(digest != crc32(session->image, session->pages * 256))
+					{
+						session->echo_errors++;
+					}
+					else
+					{
+						send_ok(session, socket);
+					}
+				}
+				break;
+			}
+			case PEER_WAIT_ECHO:
+			{
+				if(session->echo_received == 0)
+				{
+					session->first_echo_ns = host_time_ns;
+				}
+				if(data[i] != session->image[session->echo_received])
+				{
+					session->echo_errors++;
+				}
+				if(++session->echo_received == session->pages * 256)
+				{
+					session->last_echo_ns = host_time_ns;
+					send_ok(session, socket);
+				}
+				break;
+			}
+			case PEER_WAIT_DUMP:
+			{
+				if(session->echo_received == 0)
+				{
+					session->first_echo_ns = host_time_ns;
+				}
+				if(data[i] != session->image[session->echo_received])
+				{
+					session->echo_errors++;
+				}
+				if(++session->echo_received == session->pages * 256)
+				{
+					session->last_echo_ns = host_time_ns;
+					session->dump_frames = host_stats.spi_frames;
+					w5100_peer_close(socket);
+					session->state = PEER_DONE;
+				}
+				break;
+			}
+			case PEER_WAIT_STAT:
+			{
+				session->stat[session->stat_length++] = data[i];
+				if(session->stat_length == STAT_RECORD_LENGTH)
+				{
+					send_bytes(session, socket, "OK", 2);
+					session->state = PEER_DONE;
+				}
+				break;
+			}
+			case PEER_DROPPED:
+			case PEER_DONE:
+				break;
+		}
+	}
+}
+
+//the handoff block the boot loader left when it started the application, 1 if it is valid, for reason and
+//with the device's network settings, and with WarmHandoff the W5100 and SPI really were left configured
+static int handoff_ok(uint8_t reason)
+{
+	BootHandoff handoff;
+	memcpy(&handoff, (const void *)host_boot_handoff, sizeof(handoff));
+	int ok = handoff.magic == BOOT_HANDOFF_MAGIC && handoff.version == BOOT_HANDOFF_VERSION &&
+			 handoff.length == sizeof(handoff) && handoff.check == boot_handoff_check(&handoff) &&
+			 handoff.reason == reason && memcmp(handoff.device_ip_address, device_ip, 4) == 0;
+	//the timers, the INT4 input and the sleep mode are back as they were at reset
+	ok = ok && TIMSK1 == 0 && TCCR1B == 0 && TIMSK3 == 0 && TCCR3B == 0 && (EIMSK & (1<<INT4)) == 0 && EICRB == 0 &&
+		 SMCR == 0 && (PORTE & (1<<PE4)) == 0;
+	if(!Eeprom.WarmHandoff || reason < BOOT_EXIT_TIMEOUT)
+	{
+		return ok && handoff.flags == 0;
+	}
+	uint8_t chip_ip[4];
+	for(int i = 0; i < 4; i++)
+	{
+		chip_ip[i] = w5100_peek(0x000F + i);	//SIPR
+	}
+	return ok && handoff.flags == BOOT_HANDOFF_W5100_READY && memcmp(chip_ip, device_ip, 4) == 0 &&
+		   handoff.rx_layout == w5100_peek(0x001A) && handoff.tx_layout == w5100_peek(0x001B) &&
+		   handoff.socket_status[0] == 0x00 && w5100_peek(0x0403) == 0x00 && w5100_peek(0x0016) == 0x00 &&
+		   !w5100_int_asserted() && (SPCR & (1<<SPE)) && (DDRB & 0x17) == 0x17;
+}
+
+//the application side of the rest of the API (BootApi.h): a page programmed and read back, pages out of range
+//refused, the network settings, and W5100 registers through the boot loader's driver, which must leave the driver's
+//counters alone, they are in SRAM that belongs to the application
+static int api_ok(void)
+{
+	uint8_t page[256], back[256];
+	for(int i = 0; i < 256; i++)
+	{
+		page[i] = i * 7;
+	}
+	int ok = boot_api_program_page(3, page) && boot_api_read_page(3, back) && memcmp(page, back, 256) == 0 &&
+			 !boot_api_program_page(HOST_BOOT_START / 256, page) && !boot_api_read_page(HOST_FLASH_SIZE / 256, back);
+
+	uint8_t config[BOOT_API_NETWORK_CONFIG_LENGTH];
+	boot_api_network_config(config, 0);
+	ok = ok && memcmp(config + 14, device_ip, 4) == 0;
+
+	static const uint8_t chip_ip[4] = {192, 168, 1, 20};
+	uint8_t chip[4];
+	uint32_t frames = wiznet_counters.spi_frames;
+	SPCR |= 1<<SPE;		//set up by the application
+	wiznet_write_block_stateless(0x000F, chip_ip, 4);	//SIPR
+	wiznet_read_block_stateless(0x000F, chip, 4);
+	SPCR = 0;
+	return ok && memcmp(chip, chip_ip, 4) == 0 && wiznet_counters.spi_frames == frames;
+}
+
+static void make_image(uint8_t *image, uint32_t length, uint32_t seed)
+{
+	//deterministic stand-in for an application image: instruction words drawn from a skewed
+	//vocabulary, the occasional run of repeated table data, and an erased (0xFF) tail on the last page
+	uint32_t state = seed;
+	uint32_t i = 0;
+	while(i < length)
+	{
+		state = state * 1103515245 + 12345;
+		uint32_t r = state >> 8;
+		if((r & 0x3F) == 0)
+		{
+			uint32_t run = 8 + (r >> 6) % 48;
+			uint8_t value = (r >> 12) & 0x01 ? 0xFF : 0x00;
+			for(uint32_t j = 0; j < run && i < length; j++)
+			{
+				image[i++] = value;
+			}
+			continue;
+		}
+		uint32_t word = (r >> 6) % ((r & 0x40) ? 64 : 2048);
+		image[i++] = word * 37;
+		if(i < length)
+		{
+			image[i++] = 0x90 + (word >> 7);
+		}
+	}
+	uint32_t tail = length > 100 ? 100 : length;
+	memset(image + length - tail, 0xFF, tail);
+}
+
+static int run_idle(int mode)
+{
+	memset(host_flash, 0xFF, sizeof(host_flash));
+	memset(&host_stats, 0, sizeof(host_stats));
+	host_time_ns = 0;
+	Eeprom.Programmed = 1;
+	host_boot_mailbox = mode == MODE_IDLE ? 0xB007 : 0;		//BOOT_REQUEST_MAGIC
+	w5100_model_attach(0, NULL);
+	w5100_model_attach(1, NULL);
+
+	int jumped = host_run_bootloader(SESSION_TIME_LIMIT_NS);
+	int ok = jumped && host_stats.violations == 0 && handoff_ok(mode == MODE_BOOT ? BOOT_EXIT_FAST_BOOT : BOOT_EXIT_TIMEOUT);
+	if(mode == MODE_BOOT)
+	{
+		ok = ok && host_stats.spi_frames == 0;
+		printf("%-6s %9s %5s %10.3f, reset to application, %llu SPI frames\n", mode_names[mode], "", ok ? "ok" : "FAIL",
+			   host_time_ns / 1e6, (unsigned long long)host_stats.spi_frames);
+		return ok;
+	}
+	printf("%-6s %9s %5s %10.1f, listening after %.1f ms, %llu SPI frames, %llu interrupts, asleep %.1f%% of the time\n",
+		   mode_names[mode], "", ok ? "ok" : "FAIL", host_time_ns / 1e6, w5100_listen_ns / 1e6,
+		   (unsigned long long)host_stats.spi_frames, (unsigned long long)host_stats.interrupts,
+		   100.0 * host_stats.sleep_ns / host_time_ns);
+	return ok;
+}
+
+static int run_stage(uint32_t image_kb)
+{
+	uint32_t pages = image_kb * 1024 / 256;
+	uint8_t *image = malloc(pages * 256);
+	make_image(image, pages * 256, image_kb);
+
+	memset(host_flash, 0xFF, sizeof(host_flash));
+	make_image(host_flash, pages * 256, image_kb + 1);
+	memset(&host_stats, 0, sizeof(host_stats));
+	host_time_ns = 0;
+	Eeprom.Programmed = 1;
+	host_boot_mailbox = 0;
+	w5100_model_attach(0, NULL);
+	w5100_model_attach(1, NULL);
+
+	//the application, calling into the boot section
+	int staged = 1;
+	for(uint32_t page = 0; page < pages; page++)
+	{
+		staged &= boot_api_stage_page(page, image + page * 256);
+	}
+	staged &= boot_api_stage_commit(pages, crc32(image, pages * 256));
+	uint64_t stage_ns = host_time_ns;
+	staged &= api_ok();
+
+	//then resets through the watchdog
+	host_advance_ns(20000000);
+	memset(&host_stats, 0, sizeof(host_stats));
+	uint64_t reset_ns = host_time_ns;
+	int jumped = host_run_bootloader(SESSION_TIME_LIMIT_NS);
+	int flash_ok = memcmp(host_flash, image, pages * 256) == 0;
+	int ok = staged && jumped && flash_ok && Eeprom.Programmed && host_stats.violations == 0 && host_stats.spi_frames == 0 &&
+			 handoff_ok(BOOT_EXIT_STAGED);
+
+	printf("%-6s %6u KB %5s %10.1f, reset to new application, %llu pages copied, staged by the application in %.1f ms\n",
+		   mode_names[MODE_STAGE], image_kb, ok ? "ok" : "FAIL", (host_time_ns - reset_ns) / 1e6,
+		   (unsigned long long)host_stats.flash_writes, stage_ns / 1e6);
+	free(image);
+	return ok;
+}
+
+static int run_dump(uint32_t image_kb)
+{
+	uint32_t pages = image_kb * 1024 / 256;
+	uint8_t *image = malloc(pages * 256);
+	make_image(image, pages * 256, image_kb);
+
+	memset(host_flash, 0xFF, sizeof(host_flash));
+	memcpy(host_flash, image, pages * 256);
+	memset(&host_stats, 0, sizeof(host_stats));
+	host_time_ns = 0;
+	Eeprom.Programmed = 1;
+	host_boot_mailbox = 0xB007;		//BOOT_REQUEST_MAGIC
+
+	Session session;
+	memset(&session, 0, sizeof(session));
+	session.mode = MODE_DUMP;
+	session.image = image;
+	session.pages = pages;
+
+	W5100Peer peer = {session_connected, session_received, &session};
+	w5100_model_attach(0, &peer);
+
+	int jumped = host_run_bootloader(SESSION_TIME_LIMIT_NS);
+	int ok = jumped && session.state == PEER_DONE && session.connections == 2 && session.echo_received == pages * 256 &&
+			 session.echo_errors == 0 &&
+			 host_stats.violations == 0 && host_stats.flash_writes == 0 && handoff_ok(BOOT_EXIT_TIMEOUT);
+
+	double dump_s = (session.last_echo_ns - session.header_ns) / 1e9;
+	double rate = pages * 256 / dump_s;
+	printf("%-6s %6u KB %5s %10.1f, %.1f KB/s, %.1f%% of SPI, %llu SPI frames, %.1f Ctl/KB\n",
+		   mode_names[MODE_DUMP], image_kb, ok ? "ok" : "FAIL", dump_s * 1e3, rate / 1e3,
+		   100.0 * rate / WIZNET_SPI_MAX_BYTES_PER_SEC, (unsigned long long)session.dump_frames,
+		   ((double)session.dump_frames - session.bytes_sent - session.bytes_received) / image_kb);
+	free(image);
+	return ok;
+}
+
+static int run_session(int mode, uint32_t image_kb)
+{
+	uint32_t pages = image_kb * 1024 / 256;
+	uint8_t *image = malloc(pages * 256);
+	make_image(image, pages * 256, image_kb);
+
+	memset(host_flash, 0xFF, sizeof(host_flash));
+	if(mode == MODE_SPARSE)
+	{
+		//a bank-switched layout, code at the bottom, a data table in the middle and a config block at the top,
+		//over a device that holds a full image of something else
+		make_image(host_flash, pages * 256, image_kb + 1);
+		uint32_t table = pages * 5 / 8;
+		memset(image + pages / 4 * 256, 0xFF, (table - pages / 4) * 256);
+		memset(image + (table + pages / 16) * 256, 0xFF, (pages - pages / 16 - pages / 16 - table) * 256);
+	}
+	else if(mode == MODE_DELTA)
+	{
+		//the device holds the previous version, which differs in every 32nd page
+		memcpy(host_flash, image, pages * 256);
+		for(uint32_t page = 5; page < pages; page += 32)
+		{
+			host_flash[page * 256 + 17] ^= 0x5A;
+		}
+	}
+	memset(&host_stats, 0, sizeof(host_stats));
+	host_time_ns = 0;
+	Eeprom.WarmHandoff = mode == MODE_WARM;
+	host_int_wired = mode != MODE_NOINT;
+
+	Session session;
+	memset(&session, 0, sizeof(session));
+	session.mode = mode;
+	session.image = image;
+	session.pages = pages;
+	session.digests = malloc(pages * 4 + 1);
+
+	W5100Peer peer = {session_connected, session_received, &session};
+	w5100_model_attach(0, &peer);
+
+	int jumped = host_run_bootloader(SESSION_TIME_LIMIT_NS);
+	int flash_ok = memcmp(host_flash, image, pages * 256) == 0;
+	int ok = jumped && flash_ok && session.echo_errors == 0 && session.state == PEER_DONE && host_stats.violations == 0 &&
+			 handoff_ok(BOOT_EXIT_PROGRAMMED);
+	if(mode == MODE_CUT)
+	{
+		ok = ok && session.connections == 2;
+	}
+
+	double session_s = (host_time_ns - session.connect_ns) / 1e9;
+	double bus_ms = host_stats.spi_bytes * HOST_SPI_BYTE_NS / 1e6;
+	double payload_rate = (session.bytes_sent + session.bytes_received) / session_s;
+
+	printf("%-6s %6u KB %5s %10.1f %9.1f %9.1f %7u %8.1f %10llu %10llu %9.1f %9.1f %7.1f %8.1f %7.1f%%\n",
+		   mode_names[mode], image_kb, ok ? "ok" : "FAIL",
+		   session_s * 1e3,
+		   (session.first_echo_ns - session.header_ns) / 1e6,
+		   (session.last_echo_ns - session.first_echo_ns) / 1e6,
+		   session.pages_sent,
+		   session.bytes_sent / 1024.0,
+		   (unsigned long long)host_stats.spi_frames,
+		   (unsigned long long)host_stats.cs_cycles,
+		   bus_ms,
+		   host_stats.spi_frames / (double)image_kb,
+		   ((double)host_stats.spi_frames - session.bytes_sent - session.bytes_received) / image_kb,
+		   payload_rate / 1e3,
+		   100.0 * payload_rate / WIZNET_SPI_MAX_BYTES_PER_SEC);
+	if(mode == MODE_CUT && session.connections == 2)
+	{
+		printf("       closed mid-header at %.1f ms, reconnected after %.1f ms\n",
+			   (session.drop_ns - session.connect_ns) / 1e6, (session.reconnect_ns - session.drop_ns) / 1e6);
+	}
+	print_stats(&session);
+	free(session.digests);
+	free(image);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t sizes[32] = {16, 64, 128, 240};
+	int size_count = 4;
+	int first_mode = 0;
+	int last_mode = MODE_COUNT - 1;
+	int option;
+
+	while((option = getopt(argc, argv, "r:l:m:s")) != -1)
+	{
+		switch(option)
+		{
+			case 'm':
+				for(first_mode = 0; first_mode < MODE_COUNT && strcmp(optarg, mode_names[first_mode]); first_mode++);
+				if(first_mode == MODE_COUNT)
+				{
+					fprintf(stderr, "unknown mode %s\n", optarg);
+					return 2;
+				}
+				last_mode = first_mode;
+				break;
+			case 'r':
+				w5100_link.rtt_ns = strtoull(optarg, NULL, 10) * 1000;
+				break;
+			case 'l':
+				w5100_link.bytes_per_sec = strtoull(optarg, NULL, 10) * 1000000 / 8;
+				break;
+			case 's':
+				want_stats = 1;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-r rtt_us] [-l link_mbit] [-m mode] [-s] [image size in KB ...]\n", argv[0]);
+				return 2;
+		}
+	}
+	if(optind < argc)
+	{
+		size_count = 0;
+		for(int i = optind; i < argc && size_count < 32; i++)
+		{
+			sizes[size_count++] = strtoul(argv[i], NULL, 10);
+		}
+	}
+
+	printf("W5100 boot loader session, RTT %.1f ms, link %.0f Mbit/s, SPI limit %lu payload bytes/s\n",
+		   w5100_link.rtt_ns / 1e6, w5100_link.bytes_per_sec * 8 / 1e6, (unsigned long)WIZNET_SPI_MAX_BYTES_PER_SEC);
+	printf("%-6s %9s %5s %10s %9s %9s %7s %8s %10s %10s %9s %9s %7s %8s %8s\n",
+		   "Mode", "Image", "", "Total ms", "Prog ms", "Verify ms", "Pages", "Sent KB", "SPI frames", "CS cycles", "Bus ms",
+		   "Frames/KB", "Ctl/KB", "KB/s", "of SPI");
+
+	int failures = 0;
+	for(int mode = first_mode; mode <= last_mode; mode++)
+	for(int i = 0; i < (mode >= MODE_IDLE ? 1 : size_count); i++)
+	{
+		if(mode == MODE_STAGE && sizes[i] * 1024 > BOOT_STAGE_PAGES * 256UL)
+		{
+			continue;		//larger than the staging area
+		}
+#if !BOOT_DELTA
+		if(mode == MODE_DELTA)
+		{
+			continue;
+		}
+#endif
+#if !BOOT_SEGMENTS
+		if(mode == MODE_SPARSE)
+		{
+			continue;
+		}
+#endif
+#if !BOOT_STAGE
+		if(mode == MODE_STAGE)
+		{
+			continue;
+		}
+#endif
+#if !BOOT_DUMP
+		if(mode == MODE_DUMP)
+		{
+			continue;
+		}
+#endif
+		//each session runs in its own process so the boot loader starts from a clean reset
+		fflush(stdout);
+		pid_t child = fork();
+		if(child == 0)
+		{
+			int ok = mode >= MODE_IDLE ? run_idle(mode) : mode == MODE_STAGE ? run_stage(sizes[i]) :
+					 mode == MODE_DUMP ? run_dump(sizes[i]) : run_session(mode, sizes[i]);
+			fflush(stdout);
+			_exit(ok ? 0 : 1);
+		}
+		int status;
+		waitpid(child, &status, 0);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			failures++;
+		}
+	}
+	return failures ? 1 : 0;
+}
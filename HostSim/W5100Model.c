@@ -0,0 +1,574 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "W5100Model.h"
+#include "HostSim.h"
+
+//Register addresses, see the W5100 datasheet section 3
+#define MR 0x0000
+#define RMSR 0x001A
+#define TMSR 0x001B
+#define IR 0x0015
+#define IMR 0x0016
+#define SOCKET_BASE 0x0400
+#define Sn_MR 0x00
+#define Sn_CR 0x01
+#define Sn_IR 0x02
+#define Sn_SR 0x03
+#define Sn_TX_FSR 0x20
+#define Sn_TX_RD 0x22
+#define Sn_TX_WR 0x24
+#define Sn_RX_RSR 0x26
+#define Sn_RX_RD 0x28
+#define TX_MEMORY 0x4000
+#define RX_MEMORY 0x6000
+
+//Sn_IR flags
+#define IR_CON 0x01
+#define IR_DISCON 0x02
+#define IR_RECV 0x04
+#define IR_SEND_OK 0x10
+
+enum {EV_CONNECT, EV_WINDOW, EV_ARRIVE_DEVICE, EV_ARRIVE_PEER, EV_ACK_DEVICE, EV_FIN};
+
+typedef struct
+{
+	uint64_t time;
+	uint64_t seq;				//keeps events with the same time in the order they were scheduled
+	uint8_t type;
+	uint8_t socket;
+	uint32_t value;				//stream offset, window edge, or acknowledged pointer
+	uint32_t length;
+	uint8_t *data;
+} Event;
+
+typedef struct
+{
+	uint8_t status;
+	uint8_t ir;					//Sn_IR
+	uint16_t rx_wr;				//where the next received byte goes, relative pointer
+	uint16_t rx_rd;				//read pointer committed by the last RECV
+	uint16_t tx_wr;				//write pointer committed by the last SEND
+	uint16_t tx_ack;			//data up to here has been acknowledged by the peer
+
+	W5100Peer peer;
+	uint8_t attached;
+	uint8_t *out;				//peer to device stream
+	uint32_t out_length;
+	uint32_t out_capacity;
+	uint32_t out_sent;			//stream offset the peer has put on the wire
+	uint32_t peer_edge;			//stream offset the peer's view of the window allows it to send up to
+	uint32_t rx_consumed;		//stream offset the device has read up to
+} Socket;
+
+W5100Link w5100_link = {1000000, 12500000, 1460};	//1ms RTT, 100Mbit/s
+uint64_t w5100_listen_ns;
+
+static uint8_t mem[0x8000];
+static Socket sockets[W5100_SOCKETS];
+static uint64_t model_now;
+static uint64_t peer_link_free;		//time the peer to device direction of the link is next idle, all sockets share the link
+static uint64_t device_link_free;
+
+static Event *events;
+static uint32_t event_count;
+static uint32_t event_capacity;
+static uint64_t event_seq;
+
+static uint8_t frame[4];
+static uint8_t frame_position;
+
+//---------------------------------------------------------------------------------------------
+//event queue, a binary heap ordered by time
+
+static int event_before(const Event *a, const Event *b)
+{
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void schedule(uint64_t time, uint8_t type, int socket, uint32_t value, uint32_t length, uint8_t *data)
+{
+	if(event_count == event_capacity)
+	{
+		event_capacity = event_capacity ? event_capacity * 2 : 64;
+		events = realloc(events, event_capacity * sizeof(Event));
+	}
+	Event event = {time, event_seq++, type, (uint8_t)socket, value, length, data};
+	uint32_t i = event_count++;
+	while(i > 0 && event_before(&event, &events[(i - 1) / 2]))
+	{
+		events[i] = events[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	events[i] = event;
+}
+
+static Event unschedule(void)
+{
+	Event top = events[0];
+	Event last = events[--event_count];
+	uint32_t i = 0;
+	for(;;)
+	{
+		uint32_t child = i * 2 + 1;
+		if(child >= event_count)
+		{
+			break;
+		}
+		if(child + 1 < event_count && event_before(&events[child + 1], &events[child]))
+		{
+			child++;
+		}
+		if(!event_before(&events[child], &last))
+		{
+			break;
+		}
+		events[i] = events[child];
+		i = child;
+	}
+	events[i] = last;
+	return top;
+}
+
+//---------------------------------------------------------------------------------------------
+//socket memory, sized by RMSR/TMSR two bits per socket (1, 2, 4 or 8KB), allocated in socket order
+
+static void buffer_layout(uint16_t size_register, int socket, uint16_t *base_offset, uint16_t *size)
+{
+	uint16_t offset = 0;
+	*base_offset = 0;
+	*size = 0;
+	for(int s = 0; s <= socket; s++)
+	{
+		uint16_t s_size = 1024 << ((mem[size_register] >> (s * 2)) & 0x03);
+		if(offset + s_size > 0x2000)
+		{
+			s_size = 0;		//no memory left for this socket
+		}
+		if(s == socket)
+		{
+			*base_offset = offset;
+			*size = s_size;
+		}
+		offset += s_size;
+	}
+}
+
+uint32_t w5100_rx_window(int socket)
+{
+	uint16_t base, size;
+	buffer_layout(RMSR, socket, &base, &size);
+	return size;
+}
+
+static uint64_t serialise_ns(uint32_t length)
+{
+	return (uint64_t)length * 1000000000ULL / w5100_link.bytes_per_sec;
+}
+
+//---------------------------------------------------------------------------------------------
+//network
+
+static void socket_clear(int s)
+{
+	Socket *sock = &sockets[s];
+	free(sock->out);
+	W5100Peer peer = sock->peer;
+	uint8_t attached = sock->attached;
+	memset(sock, 0, sizeof(Socket));
+	sock->peer = peer;
+	sock->attached = attached;
+
+	//drop anything still in flight for this socket
+	for(uint32_t i = 0; i < event_count; i++)
+	{
+		if(events[i].socket == s)
+		{
+			free(events[i].data);
+			events[i].data = NULL;
+			events[i].type = EV_ACK_DEVICE;
+			events[i].socket = 0xFF;
+		}
+	}
+}
+
+static void peer_pump(int s)
+{
+	//the peer sends whatever it has queued, as far as the last window it saw allows
+	Socket *sock = &sockets[s];
+	while(sock->out_sent < sock->out_length && sock->out_sent < sock->peer_edge)
+	{
+		uint32_t length = sock->out_length - sock->out_sent;
+		if(length > sock->peer_edge - sock->out_sent)
+		{
+			length = sock->peer_edge - sock->out_sent;
+		}
+		if(length > w5100_link.mss)
+		{
+			length = w5100_link.mss;
+		}
+		uint64_t departure = peer_link_free > model_now ? peer_link_free : model_now;
+		peer_link_free = departure + serialise_ns(length);
+		schedule(peer_link_free + w5100_link.rtt_ns / 2, EV_ARRIVE_DEVICE, s, sock->out_sent, length, NULL);
+		sock->out_sent += length;
+	}
+}
+
+void w5100_peer_send(int socket, const uint8_t *data, uint32_t length)
+{
+	Socket *sock = &sockets[socket];
+	if(sock->out_length + length > sock->out_capacity)
+	{
+		sock->out_capacity = (sock->out_length + length) * 2;
+		sock->out = realloc(sock->out, sock->out_capacity);
+	}
+	memcpy(sock->out + sock->out_length, data, length);
+	sock->out_length += length;
+	peer_pump(socket);
+}
+
+void w5100_peer_close(int socket)
+{
+	//the FIN follows whatever the peer has already put on the wire
+	uint64_t departure = peer_link_free > model_now ? peer_link_free : model_now;
+	schedule(departure + w5100_link.rtt_ns / 2, EV_FIN, socket, 0, 0, NULL);
+}
+
+static void handle_event(const Event *event)
+{
+	if(event->socket >= W5100_SOCKETS)
+	{
+		return;		//cancelled
+	}
+	int s = event->socket;
+	Socket *sock = &sockets[s];
+	uint16_t base, size;
+
+	switch(event->type)
+	{
+		case EV_CONNECT:
+		{
+			if(sock->status == W5100_SOCK_LISTEN)
+			{
+				sock->status = W5100_SOCK_ESTABLISHED;
+				sock->ir |= IR_CON;
+				sock->peer_edge = w5100_rx_window(s);
+				if(sock->peer.connected)
+				{
+					sock->peer.connected(sock->peer.context, s);
+				}
+			}
+			break;
+		}
+		case EV_WINDOW:
+		{
+			if(event->value > sock->peer_edge)
+			{
+				sock->peer_edge = event->value;
+				peer_pump(s);
+			}
+			break;
+		}
+		case EV_ARRIVE_DEVICE:
+		{
+			buffer_layout(RMSR, s, &base, &size);
+			for(uint32_t i = 0; i < event->length; i++)
+			{
+				mem[RX_MEMORY + base + ((sock->rx_wr + i) & (size - 1))] = sock->out[event->value + i];
+			}
+			sock->rx_wr += event->length;
+			sock->ir |= IR_RECV;
+			break;
+		}
+		case EV_ARRIVE_PEER:
+		{
+			if(sock->peer.received)
+			{
+				sock->peer.received(sock->peer.context, s, event->data, event->length);
+			}
+			free(event->data);
+			break;
+		}
+		case EV_ACK_DEVICE:
+		{
+			//SEND_OK is raised when the data is acknowledged, which is when Sn_TX_FSR grows
+			sock->tx_ack = event->value;
+			sock->ir |= IR_SEND_OK;
+			break;
+		}
+		case EV_FIN:
+		{
+			if(sock->status == W5100_SOCK_ESTABLISHED)
+			{
+				sock->status = W5100_SOCK_CLOSE_WAIT;
+				sock->ir |= IR_DISCON;
+			}
+			break;
+		}
+	}
+}
+
+void w5100_model_advance(uint64_t now_ns)
+{
+	while(event_count > 0 && events[0].time <= now_ns)
+	{
+		Event event = unschedule();
+		model_now = event.time;
+		handle_event(&event);
+	}
+	model_now = now_ns;
+}
+
+uint64_t w5100_model_next_event(void)
+{
+	return event_count > 0 ? events[0].time : UINT64_MAX;
+}
+
+int w5100_int_asserted(void)
+{
+	for(int s = 0; s < W5100_SOCKETS; s++)
+	{
+		if(sockets[s].ir && (mem[IMR] & (1 << s)))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//---------------------------------------------------------------------------------------------
+//registers
+
+static void socket_command(int s, uint8_t command)
+{
+	Socket *sock = &sockets[s];
+	uint16_t reg = SOCKET_BASE + s * 0x100;
+	uint16_t base, size;
+
+	switch(command)
+	{
+		case 0x01:	//OPEN
+		{
+			socket_clear(s);
+			if((mem[reg + Sn_MR] & 0x0F) == 0x01)
+			{
+				sock->status = W5100_SOCK_INIT;
+			}
+			memset(&mem[reg + Sn_TX_WR], 0, 2);
+			memset(&mem[reg + Sn_RX_RD], 0, 2);
+			break;
+		}
+		case 0x02:	//LISTEN
+		{
+			if(sock->status == W5100_SOCK_INIT)
+			{
+				sock->status = W5100_SOCK_LISTEN;
+				w5100_listen_ns = model_now;
+				if(sock->attached)
+				{
+					schedule(model_now + w5100_link.rtt_ns, EV_CONNECT, s, 0, 0, NULL);	//SYN, SYN/ACK, ACK
+				}
+			}
+			break;
+		}
+		case 0x08:	//DISCON
+		case 0x10:	//CLOSE
+		{
+			socket_clear(s);
+			break;
+		}
+		case 0x20:	//SEND
+		{
+			if(sock->status != W5100_SOCK_ESTABLISHED)
+			{
+				break;
+			}
+			uint16_t new_wr = (mem[reg + Sn_TX_WR] << 8) | mem[reg + Sn_TX_WR + 1];
+			uint16_t length = new_wr - sock->tx_wr;
+			if(length == 0)
+			{
+				break;
+			}
+			buffer_layout(TMSR, s, &base, &size);
+			uint8_t *data = malloc(length);
+			for(uint16_t i = 0; i < length; i++)
+			{
+				data[i] = mem[TX_MEMORY + base + ((sock->tx_wr + i) & (size - 1))];
+			}
+			sock->tx_wr = new_wr;
+
+			uint64_t departure = device_link_free > model_now ? device_link_free : model_now;
+			device_link_free = departure + serialise_ns(length);
+			schedule(device_link_free + w5100_link.rtt_ns / 2, EV_ARRIVE_PEER, s, 0, length, data);
+			schedule(device_link_free + w5100_link.rtt_ns, EV_ACK_DEVICE, s, new_wr, 0, NULL);
+			break;
+		}
+		case 0x40:	//RECV
+		{
+			uint16_t new_rd = (mem[reg + Sn_RX_RD] << 8) | mem[reg + Sn_RX_RD + 1];
+			uint16_t consumed = new_rd - sock->rx_rd;
+			if(consumed > (uint16_t)(sock->rx_wr - sock->rx_rd))
+			{
+				host_violation("W5100 RECV past the received data");
+			}
+			sock->rx_rd = new_rd;
+			sock->rx_consumed += consumed;
+			//the window update reaches the peer half a round trip later
+			buffer_layout(RMSR, s, &base, &size);
+			schedule(model_now + w5100_link.rtt_ns / 2, EV_WINDOW, s, sock->rx_consumed + size, 0, NULL);
+			break;
+		}
+	}
+}
+
+static uint8_t register_read(uint16_t address)
+{
+	if(address >= SOCKET_BASE && address < SOCKET_BASE + W5100_SOCKETS * 0x100)
+	{
+		int s = (address - SOCKET_BASE) >> 8;
+		Socket *sock = &sockets[s];
+		uint16_t value;
+		uint16_t base, size;
+
+		switch(address & 0xFE)
+		{
+			case Sn_TX_FSR:
+				buffer_layout(TMSR, s, &base, &size);
+				value = size - (uint16_t)(sock->tx_wr - sock->tx_ack);
+				return (address & 1) ? value & 0xFF : value >> 8;
+			case Sn_TX_RD:
+				value = sock->tx_ack;
+				return (address & 1) ? value & 0xFF : value >> 8;
+			case Sn_RX_RSR:
+				value = sock->rx_wr - sock->rx_rd;
+				return (address & 1) ? value & 0xFF : value >> 8;
+		}
+		if((address & 0xFF) == Sn_SR)
+		{
+			return sock->status;
+		}
+		if((address & 0xFF) == Sn_IR)
+		{
+			return sock->ir;
+		}
+	}
+	if(address == IR)
+	{
+		//a socket's bit is set while it has any flag set in Sn_IR
+		uint8_t value = mem[IR] & 0xE0;
+		for(int s = 0; s < W5100_SOCKETS; s++)
+		{
+			if(sockets[s].ir)
+			{
+				value |= 1 << s;
+			}
+		}
+		return value;
+	}
+	return mem[address & 0x7FFF];
+}
+
+static void register_write(uint16_t address, uint8_t data)
+{
+	address &= 0x7FFF;
+	if(address == MR)
+	{
+		if(data & 0x80)
+		{
+			w5100_model_reset();
+		}
+		return;
+	}
+	if(address >= SOCKET_BASE && address < SOCKET_BASE + W5100_SOCKETS * 0x100 && (address & 0xFF) == Sn_CR)
+	{
+		socket_command((address - SOCKET_BASE) >> 8, data);
+		return;		//the command register reads back as 0 once the command is accepted
+	}
+	if(address >= SOCKET_BASE && address < SOCKET_BASE + W5100_SOCKETS * 0x100 && (address & 0xFF) == Sn_IR)
+	{
+		sockets[(address - SOCKET_BASE) >> 8].ir &= ~data;	//flags are cleared by writing 1
+		return;
+	}
+	if(address == IR)
+	{
+		mem[IR] &= ~(data & 0xE0);
+		return;
+	}
+	mem[address] = data;
+}
+
+uint8_t w5100_peek(uint16_t address)
+{
+	return register_read(address);
+}
+
+//---------------------------------------------------------------------------------------------
+//SPI frames: 0xF0/0x0F, address msb, address lsb, data
+
+void w5100_spi_select(void)
+{
+	frame_position = 0;
+}
+
+uint8_t w5100_spi_byte(uint8_t data)
+{
+	if(frame_position >= 4)
+	{
+		host_violation("W5100 SPI frame longer than 4 bytes");
+		return 0;
+	}
+	frame[frame_position] = data;
+	if(host_time_ns < W5100_POWER_UP_NS)
+	{
+		frame_position++;
+		return 0;		//not started yet, nothing answers
+	}
+	if(frame_position++ < 3)
+	{
+		return frame_position - 1;		//the W5100 replies 0x00, 0x01, 0x02 to the first three bytes
+	}
+
+	uint16_t address = (frame[1] << 8) | frame[2];
+	if(frame[0] == 0xF0)
+	{
+		register_write(address, data);
+		return 0x03;
+	}
+	if(frame[0] == 0x0F)
+	{
+		return register_read(address);
+	}
+	host_violation("W5100 SPI frame with an unknown opcode");
+	return 0;
+}
+
+int w5100_spi_deselect(void)
+{
+	if(frame_position != 0 && frame_position != 4)
+	{
+		host_violation("W5100 SPI frame cut short");
+	}
+	return frame_position == 4;
+}
+
+void w5100_model_reset(void)
+{
+	memset(mem, 0, sizeof(mem));
+	mem[RMSR] = 0x55;	//2KB per socket
+	mem[TMSR] = 0x55;
+	peer_link_free = 0;
+	device_link_free = 0;
+	for(int s = 0; s < W5100_SOCKETS; s++)
+	{
+		socket_clear(s);
+	}
+}
+
+void w5100_model_attach(int socket, const W5100Peer *peer)
+{
+	sockets[socket].attached = peer != NULL;
+	if(peer)
+	{
+		sockets[socket].peer = *peer;
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef W5100MODEL_H_
+#define W5100MODEL_H_
+
+//Software model of the WizNet W5100 as seen over SPI, with a simple TCP peer on the far side of the link
+//covers the common registers, the four sockets' registers, the TX/RX ring memory sized by TMSR/RMSR,
+//Sn_TX_FSR/Sn_RX_RSR and the OPEN, LISTEN, DISCON, CLOSE, SEND and RECV commands,
+//and the socket interrupts (Sn_IR CON, DISCON, RECV and SEND_OK, IR, IMR and the /INT line)
+
+#include <stdint.h>
+
+#define W5100_SOCKETS 4
+
+//Socket status register values
+#define W5100_SOCK_CLOSED 0x00
+#define W5100_SOCK_INIT 0x13
+#define W5100_SOCK_LISTEN 0x14
+#define W5100_SOCK_ESTABLISHED 0x17
+#define W5100_SOCK_CLOSE_WAIT 0x1C
+
+//the TCP peer behind a socket, the callbacks run at the modelled time the event happens
+typedef struct
+{
+	void (*connected)(void *context, int socket);
+	void (*received)(void *context, int socket, const uint8_t *data, uint32_t length);	//device to peer data
+	void *context;
+} W5100Peer;
+
+//link between the W5100 and the peer
+typedef struct
+{
+	uint64_t rtt_ns;			//round trip time
+	uint64_t bytes_per_sec;		//link rate in each direction
+	uint32_t mss;				//segment size used by the peer
+} W5100Link;
+
+extern W5100Link w5100_link;
+
+//clear the chip and the network, the link settings are kept
+void w5100_model_reset(void);
+
+//the chip ignores SPI until this long after power up (model time 0), the PLL lock time of the datasheet
+#define W5100_POWER_UP_NS 10000000ULL
+
+//model time of the latest LISTEN command
+extern uint64_t w5100_listen_ns;
+
+//attach a peer that connects to the socket as soon as it is listening, NULL detaches
+void w5100_model_attach(int socket, const W5100Peer *peer);
+
+//queue data from the peer to the device, sent as the device's advertised window allows
+void w5100_peer_send(int socket, const uint8_t *data, uint32_t length);
+
+//the peer closes its side of the TCP connection, the socket goes to CLOSE_WAIT
+void w5100_peer_close(int socket);
+
+//deliver all network events up to the given modelled time
+void w5100_model_advance(uint64_t now_ns);
+//modelled time of the next network event, UINT64_MAX if there is none
+uint64_t w5100_model_next_event(void);
+
+//1 while /INT is asserted (low), an enabled socket (IMR) has a flag set in Sn_IR
+int w5100_int_asserted(void);
+
+//SPI interface, one call per byte of the 4 byte frame
+void w5100_spi_select(void);
+uint8_t w5100_spi_byte(uint8_t data);
+int w5100_spi_deselect(void);		//returns 1 if a complete frame was clocked
+
+//direct access for the benchmark
+uint8_t w5100_peek(uint16_t address);
+uint32_t w5100_rx_window(int socket);	//RX buffer size of the socket
+
+#endif /* W5100MODEL_H_ */
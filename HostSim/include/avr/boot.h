@@ -0,0 +1,27 @@
+#ifndef HOSTSIM_AVR_BOOT_H_
+#define HOSTSIM_AVR_BOOT_H_
+
+//Host stand-in for <avr/boot.h>, SPM operations act on the flash array in HostAvr.c
+//page erase and page write keep SPMEN/RWWSB set for the modelled programming time, the _busy_wait macros
+//advance the model clock to the end of the operation
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+void host_spm_page_erase(uint32_t address);
+void host_spm_page_fill(uint32_t address, uint16_t data);
+void host_spm_page_write(uint32_t address);
+uint8_t host_spm_busy(void);
+void host_spm_busy_wait(void);
+uint8_t host_rww_busy(void);
+void host_rww_enable(void);
+
+#define boot_page_erase(address) host_spm_page_erase((uint32_t)(address))
+#define boot_page_fill(address, data) host_spm_page_fill((uint32_t)(address), (data))
+#define boot_page_write(address) host_spm_page_write((uint32_t)(address))
+#define boot_spm_busy() host_spm_busy()
+#define boot_spm_busy_wait() host_spm_busy_wait()
+#define boot_rww_busy() host_rww_busy()
+#define boot_rww_enable() host_rww_enable()
+
+#endif /* HOSTSIM_AVR_BOOT_H_ */
@@ -0,0 +1,21 @@
+#ifndef HOSTSIM_AVR_EEPROM_H_
+#define HOSTSIM_AVR_EEPROM_H_
+
+//Host stand-in for <avr/eeprom.h>, EEMEM variables are ordinary globals
+//writes take the modelled EEPROM programming time (see HostAvr.c)
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EEMEM
+
+void eeprom_busy_wait(void);
+uint8_t eeprom_is_ready(void);
+uint8_t eeprom_read_byte(const uint8_t *address);
+void eeprom_write_byte(uint8_t *address, uint8_t value);
+void eeprom_update_byte(uint8_t *address, uint8_t value);
+void eeprom_read_block(void *destination, const void *source, size_t length);
+void eeprom_update_block(const void *source, void *destination, size_t length);
+void eeprom_write_block(const void *source, void *destination, size_t length);
+
+#endif /* HOSTSIM_AVR_EEPROM_H_ */
@@ -0,0 +1,12 @@
+#ifndef HOSTSIM_AVR_INTERRUPT_H_
+#define HOSTSIM_AVR_INTERRUPT_H_
+
+//Host stand-in for <avr/interrupt.h>, ISRs become plain functions that HostAvr.c calls from the model clock
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+#define sei() (SREG |= 0x80)
+#define cli() (SREG &= (uint8_t)~0x80)
+
+#endif /* HOSTSIM_AVR_INTERRUPT_H_ */
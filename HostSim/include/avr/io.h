@@ -0,0 +1,74 @@
+#ifndef HOSTSIM_AVR_IO_H_
+#define HOSTSIM_AVR_IO_H_
+
+//Host stand-in for <avr/io.h>, only the ATmega2560 registers and bits the boot loader uses
+//registers are plain variables defined in HostAvr.c, SPI data goes through the WIZNET_ hooks in HostPort.h instead
+
+#include <stdint.h>
+
+extern volatile uint8_t DDRB, PORTB, DDRG, PORTG;
+extern volatile uint8_t SPCR, SPSR, SPDR;
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1;
+extern volatile uint16_t OCR1A, OCR3A;
+extern volatile uint8_t TCCR3A, TCCR3B, TIMSK3;
+extern volatile uint8_t MCUCR, MCUSR, SREG;
+extern volatile uint8_t DDRE, PORTE, EICRB, EIMSK, SMCR;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PG5 5
+#define PE4 4
+
+#define SPE 6
+#define MSTR 4
+#define SPIF 7
+#define SPI2X 0
+
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+#define OCIE1A 1
+#define OCIE3A 1
+#define CS32 2
+#define CS31 1
+#define CS30 0
+
+#define INT4 4
+#define ISC41 1
+#define ISC40 0
+#define SE 0
+
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+
+#define IVSEL 1
+#define IVCE 0
+
+#define SPM_PAGESIZE 256
+#define FLASHEND 0x3FFFF
+#define E2END 0xFFF
+#define RAMEND 0x21FF
+
+//TIMER3 is read by the boot loader and only cleared when it exits, its count comes from the model clock
+//and a write to TCNT3 goes to a copy that is reloaded on the next access
+volatile uint16_t *host_timer3_register(void);
+#define TCNT3 (*host_timer3_register())
+
+//PINE only has the W5100 /INT line on PE4, high (pull-up) while it is not asserted or the INT jumper is not fitted
+uint8_t host_pine(void);
+#define PINE host_pine()
+
+#define TIMER1_COMPA_vect host_timer1_compa_vect
+#define TIMER3_COMPA_vect host_timer3_compa_vect
+#define INT4_vect host_int4_vect
+
+#endif /* HOSTSIM_AVR_IO_H_ */
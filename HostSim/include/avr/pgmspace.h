@@ -0,0 +1,19 @@
+#ifndef HOSTSIM_AVR_PGMSPACE_H_
+#define HOSTSIM_AVR_PGMSPACE_H_
+
+//Host stand-in for <avr/pgmspace.h>, program memory is the flash array modelled in HostAvr.c
+//data declared PROGMEM on the host is ordinary memory, so the near reads are plain dereferences
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+uint8_t host_flash_read_byte(uint32_t address);
+
+#define pgm_read_byte_far(address) host_flash_read_byte((uint32_t)(address))
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
+
+#endif /* HOSTSIM_AVR_PGMSPACE_H_ */
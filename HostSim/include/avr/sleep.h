@@ -0,0 +1,16 @@
+#ifndef HOSTSIM_AVR_SLEEP_H_
+#define HOSTSIM_AVR_SLEEP_H_
+
+//Host stand-in for <avr/sleep.h>, sleep_cpu advances the model clock to the next interrupt (see HostAvr.c)
+
+#include <avr/io.h>
+
+void host_sleep_cpu(void);
+
+#define SLEEP_MODE_IDLE 0x00
+#define set_sleep_mode(mode) (SMCR = (SMCR & (uint8_t)~0x0E) | (mode))
+#define sleep_enable() (SMCR |= (1<<SE))
+#define sleep_disable() (SMCR &= (uint8_t)~(1<<SE))
+#define sleep_cpu() host_sleep_cpu()
+
+#endif /* HOSTSIM_AVR_SLEEP_H_ */
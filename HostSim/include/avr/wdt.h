@@ -0,0 +1,9 @@
+#ifndef HOSTSIM_AVR_WDT_H_
+#define HOSTSIM_AVR_WDT_H_
+
+//Host stand-in for <avr/wdt.h>, the model has no watchdog
+
+#define wdt_disable() ((void)0)
+#define wdt_reset() ((void)0)
+
+#endif /* HOSTSIM_AVR_WDT_H_ */
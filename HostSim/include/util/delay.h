@@ -0,0 +1,13 @@
+#ifndef HOSTSIM_UTIL_DELAY_H_
+#define HOSTSIM_UTIL_DELAY_H_
+
+//Host stand-in for <util/delay.h>, delays advance the model clock
+
+#include <stdint.h>
+
+void host_delay_us(double us);
+
+#define _delay_ms(ms) host_delay_us((ms) * 1000.0)
+#define _delay_us(us) host_delay_us(us)
+
+#endif /* HOSTSIM_UTIL_DELAY_H_ */
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+extern "C"
+{
+#include "Crc32.h"
+}
+#include "BootImage.h"
+#include "BootProtocol.h"
+
+#define ELF_DATA_SPACE 0x800000UL		//avr-gcc puts SRAM, EEPROM and the fuses from here up, flash is below
+
+static uint32_t image_crc(const uint8_t *data, uint32_t length)
+{
+	uint32_t crc = CRC32_INIT;
+	for(uint32_t i = 0; i < length; i++)
+	{
+		crc = crc32_update(crc, data[i]);
+	}
+	return crc32_final(crc);
+}
+
+static bool place(const char *path, std::vector<uint8_t> &data, uint32_t address, const uint8_t *bytes, uint32_t length)
+{
+	//copy loaded bytes to their flash address, everything not loaded stays erased
+	if(address >= BOOT_APP_SIZE || length > BOOT_APP_SIZE - address)
+	{
+		fprintf(stderr, "%s: data at 0x%05X-0x%05X is outside the application flash (0x%05lX)\n",
+				path, address, address + length - 1, BOOT_APP_SIZE);
+		return false;
+	}
+	if(data.size() < address + length)
+	{
+		data.resize(address + length, 0xFF);
+	}
+	memcpy(&data[address], bytes, length);
+	return true;
+}
+
+static uint32_t read_le(const uint8_t *p, int bytes)
+{
+	uint32_t value = 0;
+	while(bytes--)
+	{
+		value = (value << 8) | p[bytes];
+	}
+	return value;
+}
+
+static bool load_elf(const char *path, const std::vector<uint8_t> &file, std::vector<uint8_t> &data)
+{
+	//the PT_LOAD program headers of a 32 bit little endian ELF, placed at their physical (load) address
+	//so initialised .data lands in flash after .text, like avr-objcopy -O binary
+	if(file.size() < 0x34 || file[4] != 1 || file[5] != 1)
+	{
+		fprintf(stderr, "%s: only 32 bit little endian ELF files are supported\n", path);
+		return false;
+	}
+	uint32_t phoff = read_le(&file[0x1C], 4);
+	uint32_t phentsize = read_le(&file[0x2A], 2);
+	uint32_t phnum = read_le(&file[0x2C], 2);
+	for(uint32_t i = 0; i < phnum; i++)
+	{
+		uint64_t entry = phoff + (uint64_t)i * phentsize;
+		if(phentsize < 0x20 || entry + 0x20 > file.size())
+		{
+			fprintf(stderr, "%s: program header %u is truncated\n", path, i);
+			return false;
+		}
+		const uint8_t *ph = &file[entry];
+		uint32_t type = read_le(ph, 4);
+		uint32_t offset = read_le(ph + 0x04, 4);
+		uint32_t paddr = read_le(ph + 0x0C, 4);
+		uint32_t filesz = read_le(ph + 0x10, 4);
+		if(type != 1 || filesz == 0)
+		{
+			continue;	//not PT_LOAD, or only .bss
+		}
+		if(paddr >= ELF_DATA_SPACE)
+		{
+			fprintf(stderr, "%s: skipping the load segment at 0x%06X, it is not flash\n", path, paddr);
+			continue;
+		}
+		if((uint64_t)offset + filesz > file.size())
+		{
+			fprintf(stderr, "%s: load segment at 0x%05X is truncated\n", path, paddr);
+			return false;
+		}
+		if(!place(path, data, paddr, &file[offset], filesz))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static int hex_digit(char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+static bool load_hex(const char *path, const std::vector<uint8_t> &file, std::vector<uint8_t> &data)
+{
+	//Intel HEX, data records (00) with extended segment (02) and extended linear (04) addresses, until EOF (01)
+	uint32_t base = 0;
+	uint32_t line = 0;
+	size_t i = 0;
+	while(i < file.size())
+	{
+		size_t end = i;
+		while(end < file.size() && file[end] != '\n')
+		{
+			end++;
+		}
+		line++;
+		size_t length = end - i;
+		while(length > 0 && (file[i + length - 1] == '\r' || file[i + length - 1] == ' '))
+		{
+			length--;
+		}
+		const char *text = (const char *)&file[i];
+		i = end + 1;
+		if(length == 0)
+		{
+			continue;
+		}
+
+		uint8_t record[256 + 5];
+		uint32_t count = 0;
+		bool valid = text[0] == ':' && length % 2 == 1 && length >= 11 && (length - 1) / 2 <= sizeof(record);
+		for(size_t j = 1; valid && j < length; j += 2)
+		{
+			int high = hex_digit(text[j]);
+			int low = hex_digit(text[j + 1]);
+			valid = high >= 0 && low >= 0;
+			record[count++] = high << 4 | low;
+		}
+		uint8_t sum = 0;
+		for(uint32_t j = 0; valid && j < count; j++)
+		{
+			sum += record[j];
+		}
+		if(!valid || record[0] + 5U != count || sum != 0)
+		{
+			fprintf(stderr, "%s:%u: bad Intel HEX record\n", path, line);
+			return false;
+		}
+
+		uint32_t address = record[1] << 8 | record[2];
+		switch(record[3])
+		{
+			case 0x00:
+				if(!place(path, data, base + address, &record[4], record[0]))
+				{
+					return false;
+				}
+				break;
+			case 0x01:
+				return true;
+			case 0x02:
+				base = (record[4] << 8 | record[5]) << 4;
+				break;
+			case 0x04:
+				base = (uint32_t)(record[4] << 8 | record[5]) << 16;
+				break;
+			default:
+				break;	//start addresses (03, 05)
+		}
+	}
+	fprintf(stderr, "%s: no Intel HEX end of file record\n", path);
+	return false;
+}
+
+bool boot_image_load(const char *path, BootImage &image)
+{
+	FILE *file = fopen(path, "rb");
+	if(!file)
+	{
+		perror(path);
+		return false;
+	}
+	std::vector<uint8_t> contents;
+	uint8_t chunk[65536];
+	size_t length;
+	while((length = fread(chunk, 1, sizeof(chunk), file)) > 0)
+	{
+		contents.insert(contents.end(), chunk, chunk + length);
+	}
+	if(ferror(file))
+	{
+		perror(path);
+		fclose(file);
+		return false;
+	}
+	fclose(file);
+
+	const char *extension = strrchr(path, '.');
+	image.data.clear();
+	if(contents.size() >= 4 && memcmp(contents.data(), "\x7F" "ELF", 4) == 0)
+	{
+		if(!load_elf(path, contents, image.data))
+		{
+			return false;
+		}
+	}
+	else if(extension && (strcasecmp(extension, ".hex") == 0 || strcasecmp(extension, ".ihx") == 0))
+	{
+		if(!load_hex(path, contents, image.data))
+		{
+			return false;
+		}
+	}
+	else if(!place(path, image.data, 0, contents.data(), contents.size()))
+	{
+		return false;
+	}
+
+	if(image.data.empty())
+	{
+		fprintf(stderr, "%s: the image is empty\n", path);
+		return false;
+	}
+	image.pages = (image.data.size() + BOOT_PAGE_SIZE - 1) / BOOT_PAGE_SIZE;
+	image.data.resize(image.pages * BOOT_PAGE_SIZE, 0xFF);
+	image.crc = image_crc(image.data.data(), image.data.size());
+	return true;
+}
+
+static bool page_erased(const BootImage &image, uint32_t page)
+{
+	for(uint32_t i = 0; i < BOOT_PAGE_SIZE; i++)
+	{
+		if(image.data[page * BOOT_PAGE_SIZE + i] != 0xFF)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void boot_image_sparse(const BootImage &image, BootSparse &sparse)
+{
+	sparse.segments.clear();
+	for(uint32_t page = 0; page < image.pages; page++)
+	{
+		if(page_erased(image, page))
+		{
+			continue;
+		}
+		//a segment is at most 0xFFFF pages, more than the application flash holds
+		if(!sparse.segments.empty() && sparse.segments.back().start + sparse.segments.back().pages == page)
+		{
+			sparse.segments.back().pages++;
+		}
+		else
+		{
+			sparse.segments.push_back({page, 1});
+		}
+	}
+
+	uint32_t count = sparse.segments.size();
+	sparse.stream.assign({(uint8_t)count, (uint8_t)(count >> 8), (uint8_t)(count >> 16),
+						  BOOT_HEADER_SEGMENTS | BOOT_HEADER_VERIFY_CRC});
+	for(const BootSegment &segment : sparse.segments)
+	{
+		const uint8_t descriptor[4] = {(uint8_t)segment.start, (uint8_t)(segment.start >> 8),
+									   (uint8_t)segment.pages, (uint8_t)(segment.pages >> 8)};
+		sparse.stream.insert(sparse.stream.end(), descriptor, descriptor + 4);
+		const uint8_t *pages = &image.data[segment.start * BOOT_PAGE_SIZE];
+		sparse.stream.insert(sparse.stream.end(), pages, pages + segment.pages * BOOT_PAGE_SIZE);
+	}
+	sparse.pages = sparse.segments.empty() ? 0 : sparse.segments.back().start + sparse.segments.back().pages;
+	sparse.crc = image_crc(image.data.data(), sparse.pages * BOOT_PAGE_SIZE);
+}
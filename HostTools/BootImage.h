@@ -0,0 +1,41 @@
+#ifndef BOOTIMAGE_H_
+#define BOOTIMAGE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+//An application image the way the boot loader receives it, padded with 0xFF (erased flash) to whole pages
+struct BootImage
+{
+	std::vector<uint8_t> data;
+	uint32_t pages = 0;
+	uint32_t crc = 0;		//CRC32 of the padded image, as checked by the boot loader
+};
+
+//A run of pages that are not erased, the unit of a sparse (HEADER_SEGMENTS) upload
+struct BootSegment
+{
+	uint32_t start;
+	uint32_t pages;
+};
+
+//The PROG payload of a sparse upload: the header, then each segment's descriptor and pages
+//the boot loader erases the pages between segments and checks pages 0 to the end of the last segment
+//against the CRC, so that is the part of the image the CRC here covers
+struct BootSparse
+{
+	std::vector<BootSegment> segments;
+	std::vector<uint8_t> stream;
+	uint32_t pages = 0;		//end of the last segment
+	uint32_t crc = 0;
+};
+
+//read an image, an ELF file (its flash load segments), Intel HEX (.hex or .ihx) or else a raw binary
+//prints why and returns false if it can't be used
+bool boot_image_load(const char *path, BootImage &image);
+
+//split an image into its runs of non-erased pages, and build the sparse upload from them
+void boot_image_sparse(const BootImage &image, BootSparse &sparse);
+
+#endif /* BOOTIMAGE_H_ */
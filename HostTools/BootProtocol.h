@@ -0,0 +1,52 @@
+#ifndef BOOTPROTOCOL_H_
+#define BOOTPROTOCOL_H_
+
+//Constants of the boot loader's TCP protocol shared by the host tools
+//see the state machine in W5100TCPBootloader/W5100TCPBootloader.c for the device side
+
+#define BOOT_PORT 13005						//Listen_Port of the boot loader
+#define BOOT_PAGE_SIZE 256					//SPM_PAGESIZE of the ATmega2560
+#define BOOT_APP_SIZE 0x3E000UL				//application flash below the boot section
+#define BOOT_APP_PAGES (BOOT_APP_SIZE / BOOT_PAGE_SIZE)
+#define BOOT_FLASH_SIZE 0x40000UL			//the whole flash, with the boot section
+
+#define BOOT_VERSION_REPLY "V1.0\r\n"		//reply to every command, 6 bytes
+#define BOOT_VERSION_LENGTH 6
+
+//DLTA and DUMP are build options of the boot loader (W5100TCPBootloader/BootConfig.h), one built
+//without them sends no version reply and the host times out. So are sparse images, without them a header with
+//BOOT_HEADER_SEGMENTS closes the connection
+
+//option flags in the top byte of the page count in the header
+#define BOOT_HEADER_VERIFY_CRC 0x01			//VERIFY returns a CRC32 of the whole image instead of the pages
+#define BOOT_HEADER_SEGMENTS 0x02			//sparse image, the count is of segments, each a start page and page count
+											//(2 bytes each) followed by its pages, VERIFY always returns the image CRC
+
+//DUMP, followed by the start address and length of a range of the flash (4 bytes each, little endian, inside
+//BOOT_FLASH_SIZE), the device sends the range as it is after the version reply and then waits for the next command.
+//A range outside the flash closes the connection and the device listens for the next one
+#define BOOT_DUMP_RANGE_LENGTH 8
+
+//STAT, sent in place of PROG or in place of OK once the image is verified (then OK is still expected),
+//returns the device's performance counters since the boot loader started. The record is little endian:
+//version, length, tick length in us (2 bytes), then the counters below as 32bit values
+#define BOOT_STAT_VERSION 1
+#define BOOT_STAT_LENGTH 52
+enum
+{
+	BOOT_STAT_SPI_FRAMES,			//SPI frames to the W5100, 4 bytes each
+	BOOT_STAT_RX_BYTES,
+	BOOT_STAT_TX_BYTES,
+	BOOT_STAT_PAGES_PROGRAMMED,
+	BOOT_STAT_PAGES_ERASED,			//erased without being written, the gaps of sparse images
+	BOOT_STAT_RUN_TICKS,			//the rest are times in ticks
+	BOOT_STAT_RX_WAIT_TICKS,		//idle, waiting for data from the host
+	BOOT_STAT_TX_WAIT_TICKS,		//idle, waiting for room in the transmit buffer
+	BOOT_STAT_FLASH_WAIT_TICKS,		//idle, waiting for a page erase or write
+	BOOT_STAT_ERASE_TICKS,			//page erases in the background
+	BOOT_STAT_WRITE_TICKS,			//page writes in the background
+	BOOT_STAT_READBACK_TICKS,		//reading the flash back for echoes, digests and CRCs
+	BOOT_STAT_COUNTERS
+};
+
+#endif /* BOOTPROTOCOL_H_ */
@@ -0,0 +1,470 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "Crc32.h"
+}
+#include "BootProtocol.h"
+
+//Read the flash of many boot loaders at once (DUMP), for backups before an update and for auditing what a fleet runs
+//every device gets a non-blocking connection driven from a single epoll loop, like W5100Upload. The range is the
+//application section unless -a and -n say otherwise. For each device the CRC32 of its range and the length up to its
+//last programmed (not 0xFF) byte are printed, then the number of devices with each CRC, so devices running the same
+//image are counted together. With -o every dump is written to dir/host_port.bin. Failed devices are retried.
+//The boot loader goes back to waiting for a command after a dump, so a device requested with the SRAM mailbox or
+//EnterBootloader starts its application again 10s after the connection is closed
+//
+//usage: W5100Dump [-a address] [-n length] [-o dir] [-j max_active] [-r retries] [-t timeout_s] [-f hosts_file]
+//                 [host[:port] ...]
+
+#define DEFAULT_MAX_ACTIVE 256
+#define DEFAULT_RETRIES 2
+#define DEFAULT_TIMEOUT_S 15		//no progress for this long fails the attempt
+#define RETRY_DELAY_NS 2000000000ULL
+
+enum class State
+{
+	Queued,			//waiting for a connection slot or for the retry delay
+	Connecting,
+	WaitStart,		//DUMP and the range sent, waiting for the version reply
+	Dumping,		//receiving the range
+	Done,
+	Failed
+};
+
+static const char *state_names[] = {"queued", "connecting", "WAIT_START", "DUMP", "done", "failed"};
+
+struct Device
+{
+	std::string name;
+	sockaddr_storage address;
+	socklen_t address_length;
+
+	State state = State::Queued;
+	int fd = -1;
+	int attempts = 0;
+	std::string error;
+
+	uint8_t reply[BOOT_VERSION_LENGTH];
+	size_t reply_length = 0;
+	std::vector<uint8_t> data;
+	uint32_t crc = 0;
+	uint32_t used = 0;			//length up to the last byte that is not erased
+
+	uint64_t retry_ns = 0;
+	uint64_t attempt_ns = 0;	//start of the current attempt
+	uint64_t progress_ns = 0;	//last time data moved
+	uint64_t end_ns = 0;
+	uint64_t bytes_received = 0;
+};
+
+static uint32_t dump_address = 0;
+static uint32_t dump_length = BOOT_APP_SIZE;
+static const char *output_dir;
+static int epoll_fd;
+static int max_active = DEFAULT_MAX_ACTIVE;
+static int retries = DEFAULT_RETRIES;
+static uint64_t timeout_ns = DEFAULT_TIMEOUT_S * 1000000000ULL;
+static int active;
+
+static uint64_t now_ns(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void close_device(Device &device)
+{
+	if(device.fd >= 0)
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, device.fd, NULL);
+		close(device.fd);
+		device.fd = -1;
+		active--;
+	}
+}
+
+static void fail(Device &device, const std::string &message)
+{
+	close_device(device);
+	device.error = std::string(state_names[(int)device.state]) + ": " + message;
+	device.end_ns = now_ns();
+	if(device.attempts <= retries)
+	{
+		device.state = State::Queued;
+		device.retry_ns = device.end_ns + RETRY_DELAY_NS;
+	}
+	else
+	{
+		device.state = State::Failed;
+	}
+}
+
+static void start(Device &device)
+{
+	device.attempts++;
+	device.attempt_ns = device.progress_ns = now_ns();
+	device.reply_length = 0;
+	device.data.clear();
+
+	device.fd = socket(device.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(device.fd < 0)
+	{
+		fail(device, strerror(errno));
+		return;
+	}
+	active++;
+
+	epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = &device;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, device.fd, &event);
+
+	device.state = State::Connecting;
+	if(connect(device.fd, (sockaddr *)&device.address, device.address_length) < 0 && errno != EINPROGRESS)
+	{
+		fail(device, strerror(errno));
+	}
+}
+
+static bool write_dump(Device &device)
+{
+	std::string path = std::string(output_dir) + "/" + device.name + ".bin";
+	for(size_t i = strlen(output_dir) + 1; i < path.size(); i++)
+	{
+		if(path[i] == ':' || path[i] == '/')
+		{
+			path[i] = '_';
+		}
+	}
+	FILE *file = fopen(path.c_str(), "wb");
+	if(!file || fwrite(device.data.data(), 1, device.data.size(), file) != device.data.size() || fclose(file) != 0)
+	{
+		device.error = path + ": " + strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+static bool receive(Device &device, const uint8_t *data, size_t length)
+{
+	//handle bytes from the device, returns false once the attempt has failed or is complete
+	if(device.state == State::WaitStart)
+	{
+		size_t take = BOOT_VERSION_LENGTH - device.reply_length < length ? BOOT_VERSION_LENGTH - device.reply_length : length;
+		memcpy(device.reply + device.reply_length, data, take);
+		device.reply_length += take;
+		data += take;
+		length -= take;
+		if(device.reply_length < BOOT_VERSION_LENGTH)
+		{
+			return true;
+		}
+		if(memcmp(device.reply, BOOT_VERSION_REPLY, BOOT_VERSION_LENGTH) != 0)
+		{
+			fail(device, "unexpected version reply");
+			return false;
+		}
+		device.state = State::Dumping;
+	}
+	if(device.state != State::Dumping || device.data.size() + length > dump_length)
+	{
+		fail(device, "unexpected data");
+		return false;
+	}
+
+	device.data.insert(device.data.end(), data, data + length);
+	if(device.data.size() == dump_length)
+	{
+		//the device is back to waiting for a command, it starts the application after its timeout
+		close_device(device);
+		device.end_ns = now_ns();
+		device.crc = crc32_final(crc32_update_block(CRC32_INIT, device.data.data(), device.data.size()));
+		device.used = dump_length;
+		while(device.used > 0 && device.data[device.used - 1] == 0xFF)
+		{
+			device.used--;
+		}
+		device.error.clear();
+		device.state = output_dir && !write_dump(device) ? State::Failed : State::Done;
+		return false;
+	}
+	return true;
+}
+
+static void handle(Device &device, uint32_t events)
+{
+	if(device.state == State::Connecting)
+	{
+		int error = 0;
+		socklen_t length = sizeof(error);
+		getsockopt(device.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+		if(error)
+		{
+			fail(device, strerror(error));
+			return;
+		}
+		if(!(events & EPOLLOUT))
+		{
+			return;
+		}
+		//the command and the range together, the device reads the range once it has replied
+		uint8_t request[4 + BOOT_DUMP_RANGE_LENGTH] = {'D', 'U', 'M', 'P'};
+		for(int i = 0; i < 4; i++)
+		{
+			request[4 + i] = dump_address >> (i * 8);
+			request[8 + i] = dump_length >> (i * 8);
+		}
+		if(send(device.fd, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request))
+		{
+			fail(device, errno ? strerror(errno) : "short write");
+			return;
+		}
+		device.state = State::WaitStart;
+	}
+
+	//edge triggered, so read until the socket is empty
+	uint8_t buffer[16384];
+	while(true)
+	{
+		ssize_t length = recv(device.fd, buffer, sizeof(buffer), 0);
+		if(length > 0)
+		{
+			device.bytes_received += length;
+			device.progress_ns = now_ns();
+			if(!receive(device, buffer, length))
+			{
+				return;
+			}
+			continue;
+		}
+		if(length == 0)
+		{
+			fail(device, "connection closed by the device");
+			return;
+		}
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			fail(device, strerror(errno));
+			return;
+		}
+		break;
+	}
+}
+
+static bool add_device(std::vector<Device> &devices, const std::string &target)
+{
+	std::string host = target;
+	std::string port = std::to_string(BOOT_PORT);
+	size_t colon = target.rfind(':');
+	if(colon != std::string::npos)
+	{
+		host = target.substr(0, colon);
+		port = target.substr(colon + 1);
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *result;
+	int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+	if(error)
+	{
+		fprintf(stderr, "%s: %s\n", target.c_str(), gai_strerror(error));
+		return false;
+	}
+
+	Device device;
+	device.name = target;
+	memcpy(&device.address, result->ai_addr, result->ai_addrlen);
+	device.address_length = result->ai_addrlen;
+	freeaddrinfo(result);
+	devices.push_back(device);
+	return true;
+}
+
+static bool read_hosts(std::vector<Device> &devices, const char *path)
+{
+	//one host[:port] per line, blank lines and # comments are skipped
+	FILE *file = fopen(path, "r");
+	if(!file)
+	{
+		perror(path);
+		return false;
+	}
+	char line[256];
+	bool ok = true;
+	while(fgets(line, sizeof(line), file))
+	{
+		char *end = line + strcspn(line, "#\r\n");
+		while(end > line && (end[-1] == ' ' || end[-1] == '\t'))
+		{
+			end--;
+		}
+		*end = 0;
+		char *begin = line + strspn(line, " \t");
+		if(*begin && !add_device(devices, begin))
+		{
+			ok = false;
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<Device> devices;
+	int option;
+
+	while((option = getopt(argc, argv, "a:n:o:j:r:t:f:")) != -1)
+	{
+		switch(option)
+		{
+			case 'a':
+				dump_address = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				dump_length = strtoul(optarg, NULL, 0);
+				break;
+			case 'o':
+				output_dir = optarg;
+				break;
+			case 'j':
+				max_active = atoi(optarg);
+				break;
+			case 'r':
+				retries = atoi(optarg);
+				break;
+			case 't':
+				timeout_ns = strtoull(optarg, NULL, 10) * 1000000000ULL;
+				break;
+			case 'f':
+				if(!read_hosts(devices, optarg))
+				{
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-a address] [-n length] [-o dir] [-j max_active] [-r retries] [-t timeout_s] "
+						"[-f hosts_file] [host[:port] ...]\n", argv[0]);
+				return 2;
+		}
+	}
+	if(max_active < 1)
+	{
+		fprintf(stderr, "usage: %s [-a address] [-n length] [-o dir] [-j max_active] [-r retries] [-t timeout_s] "
+				"[-f hosts_file] [host[:port] ...]\n", argv[0]);
+		return 2;
+	}
+	if(dump_length == 0 || dump_address > BOOT_FLASH_SIZE || dump_length > BOOT_FLASH_SIZE - dump_address)
+	{
+		fprintf(stderr, "%s: the range must be in the %lu bytes of flash\n", argv[0], (unsigned long)BOOT_FLASH_SIZE);
+		return 2;
+	}
+	for(int i = optind; i < argc; i++)
+	{
+		if(!add_device(devices, argv[i]))
+		{
+			return 1;
+		}
+	}
+	if(devices.empty())
+	{
+		fprintf(stderr, "%s: no devices given\n", argv[0]);
+		return 2;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	uint64_t run_start = now_ns();
+	size_t finished = 0;
+
+	while(finished < devices.size())
+	{
+		uint64_t now = now_ns();
+
+		//start devices while there are free slots
+		for(Device &device : devices)
+		{
+			if(active >= max_active)
+			{
+				break;
+			}
+			if(device.state == State::Queued && device.retry_ns <= now)
+			{
+				start(device);
+			}
+		}
+
+		epoll_event events[256];
+		int count = epoll_wait(epoll_fd, events, 256, 50);
+		for(int i = 0; i < count; i++)
+		{
+			handle(*(Device *)events[i].data.ptr, events[i].events);
+		}
+
+		//fail attempts that stopped making progress
+		now = now_ns();
+		finished = 0;
+		for(Device &device : devices)
+		{
+			if(device.fd >= 0 && now - device.progress_ns > timeout_ns)
+			{
+				fail(device, "timed out");
+			}
+			if(device.state == State::Done || device.state == State::Failed)
+			{
+				finished++;
+			}
+		}
+	}
+	double run_s = (now_ns() - run_start) / 1e9;
+
+	printf("%-24s %6s %8s %10s %9s %8s %8s  %s\n", "Device", "", "Attempts", "Time ms", "KB/s", "CRC32", "Used", "Last error");
+	int ok_count = 0;
+	uint64_t bytes_moved = 0;
+	std::map<uint32_t, int> images;
+	for(Device &device : devices)
+	{
+		double attempt_s = (device.end_ns - device.attempt_ns) / 1e9;
+		bool ok = device.state == State::Done;
+		ok_count += ok;
+		bytes_moved += device.bytes_received;
+		printf("%-24s %6s %8d %10.1f %9.1f ", device.name.c_str(), ok ? "ok" : "FAIL", device.attempts, attempt_s * 1e3,
+			   ok ? dump_length / attempt_s / 1e3 : 0.0);
+		if(ok)
+		{
+			images[device.crc]++;
+			printf("%08X %8u  %s\n", device.crc, device.used, device.error.c_str());
+		}
+		else
+		{
+			printf("%8s %8s  %s\n", "", "", device.error.c_str());
+		}
+	}
+
+	for(const auto &image : images)
+	{
+		printf("CRC32 %08X: %d device%s\n", image.first, image.second, image.second == 1 ? "" : "s");
+	}
+	printf("%d of %zu devices dumped, 0x%05X bytes from 0x%05X, %.1f s, %.1f KB/s on the wire\n",
+		   ok_count, devices.size(), dump_length, dump_address, run_s, bytes_moved / run_s / 1e3);
+	return ok_count == (int)devices.size() ? 0 : 1;
+}
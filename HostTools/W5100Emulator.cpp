@@ -0,0 +1,545 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+extern "C"
+{
+#include "Crc32.h"
+}
+#include "BootProtocol.h"
+
+//Loopback stand-in for a set of boot loaders, for running W5100Upload and W5100Dump without hardware
+//each emulated device listens on its own port of 127.0.0.1 and answers PROG the way the boot loader does:
+//version reply, header, pages, then the page echo (or the image CRC when the header asks for it) and OK.
+//a sparse header (BOOT_HEADER_SEGMENTS) is followed by segments, the pages between them are erased.
+//pages are taken from the socket no faster than the flash could program them, and the receive buffer
+//is about the size of the W5100's, so the uploader sees the same back pressure as from a real device.
+//STAT returns the counters the emulator can know (bytes, pages, flash time), there is no SPI to count
+//DUMP sends a range of the emulated flash, the boot section reads as erased
+//
+//usage: W5100Emulator [-n devices] [-p first_port] [-b first_ip] [-t page_us] [-w window] [-x every] [-s sessions]
+//  -b first_ip the devices listen on consecutive addresses from first_ip, all on first_port
+//  -x every    corrupt the first session of every Nth device, to exercise the uploader's retries
+//  -s sessions exit after this many successful sessions (programmed or dumped), otherwise run until killed
+
+#define DEFAULT_DEVICES 16
+#define DEFAULT_FIRST_PORT 13005
+#define DEFAULT_PAGE_US 8000		//page erase and write, as measured by the HostSim bench
+#define DEFAULT_WINDOW 8192
+
+enum State {WAIT_START, HEADER, SEGMENT, PROGRAMMING, VERIFY, OK, STAT_TAIL, DUMP_RANGE};
+
+struct EmulatedDevice
+{
+	int listen_fd;
+	in_addr ip;
+	uint16_t port;
+	std::vector<uint8_t> flash;
+
+	int fd = -1;
+	State state = WAIT_START;
+	uint8_t in[BOOT_PAGE_SIZE];
+	size_t in_length = 0;
+	uint32_t pages = 0;
+	uint32_t page_index = 0;
+	bool crc_verify = false;
+	bool sparse = false;
+	uint32_t segments_left = 0;
+	uint32_t segment_pages = 0;		//pages of the current segment still to come
+	uint64_t flash_ready_ns = 0;		//the previous page has been programmed
+	std::vector<uint8_t> out;
+	size_t out_position = 0;
+
+	//performance counters, as returned by STAT
+	uint64_t start_ns = 0;
+	uint32_t counters[BOOT_STAT_COUNTERS] = {};
+
+	int sessions = 0;
+	int programmed = 0;
+	int dumps = 0;
+	bool corrupt = false;				//the next session writes a bad byte
+};
+
+static int epoll_fd;
+static uint64_t page_ns = DEFAULT_PAGE_US * 1000ULL;
+static int window = DEFAULT_WINDOW;
+
+static uint64_t now_ns(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t wanted(const EmulatedDevice &device)
+{
+	//bytes the current state reads at once
+	switch(device.state)
+	{
+		case WAIT_START:
+		case HEADER:
+		case SEGMENT:
+			return 4;
+		case DUMP_RANGE:
+			return BOOT_DUMP_RANGE_LENGTH;
+		case PROGRAMMING:
+			return BOOT_PAGE_SIZE;
+		case OK:
+		case STAT_TAIL:
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+static void update_events(EmulatedDevice &device, uint64_t now)
+{
+	//level triggered, only ask for input when the state can take it
+	epoll_event event;
+	event.events = 0;
+	if(wanted(device) && (device.state != PROGRAMMING || now >= device.flash_ready_ns))
+	{
+		event.events |= EPOLLIN;
+	}
+	if(device.out_position < device.out.size())
+	{
+		event.events |= EPOLLOUT;
+	}
+	event.data.ptr = &device;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, device.fd, &event);
+}
+
+static void end_session(EmulatedDevice &device)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, device.fd, NULL);
+	close(device.fd);
+	device.fd = -1;
+	device.state = WAIT_START;
+	device.in_length = 0;
+	device.out.clear();
+	device.out_position = 0;
+}
+
+static void send_bytes(EmulatedDevice &device, const void *data, size_t length)
+{
+	device.out.insert(device.out.end(), (const uint8_t *)data, (const uint8_t *)data + length);
+}
+
+static void send_stats(EmulatedDevice &device, uint64_t now)
+{
+	//flash times are charged at half the page time for the erase and half for the write
+	const uint32_t tick_us = 16;
+	uint32_t page_ticks = page_ns / 1000 / tick_us / 2;
+	device.counters[BOOT_STAT_RUN_TICKS] = (now - device.start_ns) / 1000 / tick_us;
+	device.counters[BOOT_STAT_ERASE_TICKS] = (device.counters[BOOT_STAT_PAGES_PROGRAMMED] +
+											  device.counters[BOOT_STAT_PAGES_ERASED]) * page_ticks;
+	device.counters[BOOT_STAT_WRITE_TICKS] = device.counters[BOOT_STAT_PAGES_PROGRAMMED] * page_ticks;
+
+	uint8_t record[BOOT_STAT_LENGTH] = {BOOT_STAT_VERSION, BOOT_STAT_LENGTH, tick_us, 0};
+	for(int i = 0; i < BOOT_STAT_COUNTERS; i++)
+	{
+		for(int j = 0; j < 4; j++)
+		{
+			record[4 + i * 4 + j] = device.counters[i] >> (j * 8);
+		}
+	}
+	send_bytes(device, record, BOOT_STAT_LENGTH);
+}
+
+static void programmed(EmulatedDevice &device)
+{
+	//every page is in, send the image CRC or echo it
+	device.corrupt = false;
+	if(device.crc_verify)
+	{
+		uint32_t crc = CRC32_INIT;
+		for(uint32_t i = 0; i < device.pages * BOOT_PAGE_SIZE; i++)
+		{
+			crc = crc32_update(crc, device.flash[i]);
+		}
+		crc = crc32_final(crc);
+		uint8_t digest[4] = {(uint8_t)crc, (uint8_t)(crc >> 8), (uint8_t)(crc >> 16), (uint8_t)(crc >> 24)};
+		send_bytes(device, digest, 4);
+	}
+	else
+	{
+		send_bytes(device, device.flash.data(), device.pages * BOOT_PAGE_SIZE);
+	}
+	device.state = OK;
+}
+
+static void step(EmulatedDevice &device, uint64_t now)
+{
+	//act on a complete input of the current state
+	switch(device.state)
+	{
+		case WAIT_START:
+		{
+			if(memcmp(device.in, "PROG", 4) == 0)
+			{
+				send_bytes(device, BOOT_VERSION_REPLY, BOOT_VERSION_LENGTH);
+				device.state = HEADER;
+			}
+			else if(memcmp(device.in, "DUMP", 4) == 0)
+			{
+				send_bytes(device, BOOT_VERSION_REPLY, BOOT_VERSION_LENGTH);
+				device.state = DUMP_RANGE;
+			}
+			else if(memcmp(device.in, "STAT", 4) == 0)
+			{
+				send_bytes(device, BOOT_VERSION_REPLY, BOOT_VERSION_LENGTH);
+				send_stats(device, now);
+			}
+			break;
+		}
+		case DUMP_RANGE:
+		{
+			uint32_t address = device.in[0] | (device.in[1] << 8) | (device.in[2] << 16) | ((uint32_t)device.in[3] << 24);
+			uint32_t length = device.in[4] | (device.in[5] << 8) | (device.in[6] << 16) | ((uint32_t)device.in[7] << 24);
+			if(address > BOOT_FLASH_SIZE || length > BOOT_FLASH_SIZE - address)
+			{
+				end_session(device);
+				return;
+			}
+			for(uint32_t end = address + length; address < end; )
+			{
+				//the application section, then the boot section, which is not emulated
+				uint32_t run = address < BOOT_APP_SIZE ? std::min(end, (uint32_t)BOOT_APP_SIZE) - address : end - address;
+				if(address < BOOT_APP_SIZE)
+				{
+					send_bytes(device, &device.flash[address], run);
+				}
+				else
+				{
+					device.out.insert(device.out.end(), run, 0xFF);
+				}
+				address += run;
+			}
+			device.dumps++;
+			device.state = WAIT_START;
+			break;
+		}
+		case HEADER:
+		{
+			device.pages = device.in[0] | (device.in[1] << 8) | (device.in[2] << 16);
+			device.crc_verify = (device.in[3] & BOOT_HEADER_VERIFY_CRC) != 0;
+			device.sparse = (device.in[3] & BOOT_HEADER_SEGMENTS) != 0;
+			device.page_index = 0;
+			device.sessions++;
+			if(device.sparse)
+			{
+				//the page count is known once the last segment is in
+				device.segments_left = device.pages;
+				device.pages = 0;
+				device.crc_verify = true;
+				if(device.segments_left == 0)
+				{
+					programmed(device);
+				}
+				else
+				{
+					device.state = SEGMENT;
+				}
+				break;
+			}
+			device.state = device.pages > 0 && device.pages <= BOOT_APP_PAGES ? PROGRAMMING : WAIT_START;
+			break;
+		}
+		case SEGMENT:
+		{
+			uint32_t start = device.in[0] | (device.in[1] << 8);
+			device.segment_pages = device.in[2] | (device.in[3] << 8);
+			device.segments_left--;
+			if(start < device.page_index || device.segment_pages == 0 || start + device.segment_pages > BOOT_APP_PAGES)
+			{
+				device.state = WAIT_START;
+				break;
+			}
+			//erase the gap, about half the time of programming a page each
+			std::fill(&device.flash[device.page_index * BOOT_PAGE_SIZE], &device.flash[start * BOOT_PAGE_SIZE], 0xFF);
+			device.counters[BOOT_STAT_PAGES_ERASED] += start - device.page_index;
+			device.flash_ready_ns = std::max(device.flash_ready_ns, now) + (start - device.page_index) * page_ns / 2;
+			device.page_index = start;
+			device.state = PROGRAMMING;
+			break;
+		}
+		case PROGRAMMING:
+		{
+			uint8_t *page = &device.flash[device.page_index * BOOT_PAGE_SIZE];
+			memcpy(page, device.in, BOOT_PAGE_SIZE);
+			if(device.corrupt && device.page_index == 0)
+			{
+				page[17] ^= 0x5A;
+			}
+			device.flash_ready_ns = now + page_ns;
+			device.page_index++;
+			device.counters[BOOT_STAT_PAGES_PROGRAMMED]++;
+			if(device.sparse && --device.segment_pages == 0)
+			{
+				if(device.segments_left > 0)
+				{
+					device.state = SEGMENT;
+				}
+				else
+				{
+					device.pages = device.page_index;
+					programmed(device);
+				}
+			}
+			else if(!device.sparse && device.page_index == device.pages)
+			{
+				programmed(device);
+			}
+			break;
+		}
+		case OK:
+		{
+			if(memcmp(device.in, "OK", 2) == 0)
+			{
+				//the boot loader would now jump to the application
+				device.programmed++;
+				end_session(device);
+				return;
+			}
+			if(memcmp(device.in, "ST", 2) == 0)
+			{
+				device.state = STAT_TAIL;
+			}
+			break;
+		}
+		case STAT_TAIL:
+		{
+			if(memcmp(device.in, "AT", 2) == 0)
+			{
+				send_stats(device, now);
+			}
+			device.state = OK;
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+static void handle(EmulatedDevice &device, uint32_t events)
+{
+	uint64_t now = now_ns();
+	if(events & EPOLLIN)
+	{
+		size_t length = wanted(device);
+		ssize_t received = recv(device.fd, device.in + device.in_length, length - device.in_length, 0);
+		if(received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			//the host gave up, wait for the next connection
+			end_session(device);
+			return;
+		}
+		if(received > 0)
+		{
+			device.counters[BOOT_STAT_RX_BYTES] += received;
+			device.in_length += received;
+			if(device.in_length == length)
+			{
+				device.in_length = 0;
+				step(device, now);
+				if(device.fd < 0)
+				{
+					return;
+				}
+			}
+		}
+	}
+	if(device.out_position < device.out.size())
+	{
+		ssize_t sent = send(device.fd, device.out.data() + device.out_position, device.out.size() - device.out_position,
+							MSG_NOSIGNAL);
+		if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			end_session(device);
+			return;
+		}
+		if(sent > 0)
+		{
+			device.counters[BOOT_STAT_TX_BYTES] += sent;
+			device.out_position += sent;
+		}
+		if(device.out_position == device.out.size())
+		{
+			device.out.clear();
+			device.out_position = 0;
+		}
+	}
+	update_events(device, now);
+}
+
+static void accept_connection(EmulatedDevice &device)
+{
+	int fd = accept4(device.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(fd < 0)
+	{
+		return;
+	}
+	if(device.fd >= 0)
+	{
+		//the boot loader only listens on one socket
+		close(fd);
+		return;
+	}
+	device.fd = fd;
+	device.state = WAIT_START;
+	epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = &device;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int main(int argc, char **argv)
+{
+	int device_count = DEFAULT_DEVICES;
+	int first_port = DEFAULT_FIRST_PORT;
+	const char *first_ip = NULL;
+	int corrupt_every = 0;
+	int session_limit = 0;
+	int option;
+
+	while((option = getopt(argc, argv, "n:p:b:t:w:x:s:")) != -1)
+	{
+		switch(option)
+		{
+			case 'n':
+				device_count = atoi(optarg);
+				break;
+			case 'p':
+				first_port = atoi(optarg);
+				break;
+			case 'b':
+				first_ip = optarg;
+				break;
+			case 't':
+				page_ns = strtoull(optarg, NULL, 10) * 1000;
+				break;
+			case 'w':
+				window = atoi(optarg);
+				break;
+			case 'x':
+				corrupt_every = atoi(optarg);
+				break;
+			case 's':
+				session_limit = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n devices] [-p first_port] [-b first_ip] [-t page_us] [-w window] [-x every] "
+						"[-s sessions]\n", argv[0]);
+				return 2;
+		}
+	}
+	in_addr base;
+	base.s_addr = htonl(INADDR_LOOPBACK);
+	if(first_ip && inet_pton(AF_INET, first_ip, &base) != 1)
+	{
+		fprintf(stderr, "%s: bad address %s\n", argv[0], first_ip);
+		return 2;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	std::vector<EmulatedDevice> devices(device_count);
+	for(int i = 0; i < device_count; i++)
+	{
+		EmulatedDevice &device = devices[i];
+		device.start_ns = now_ns();
+		device.ip.s_addr = first_ip ? htonl(ntohl(base.s_addr) + i) : base.s_addr;
+		device.port = first_ip ? first_port : first_port + i;
+		device.flash.assign(BOOT_APP_SIZE, 0xFF);
+		device.corrupt = corrupt_every > 0 && i % corrupt_every == 0;
+
+		device.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		int one = 1;
+		setsockopt(device.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		setsockopt(device.listen_fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));	//inherited by the connection
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(device.port);
+		address.sin_addr = device.ip;
+		if(bind(device.listen_fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(device.listen_fd, 1) < 0)
+		{
+			fprintf(stderr, "%s: %s:%u: %s\n", argv[0], inet_ntoa(device.ip), device.port, strerror(errno));
+			return 1;
+		}
+
+		epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		event.data.u64 = i;		//listening sockets are told apart from devices by the small value
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, device.listen_fd, &event);
+	}
+	if(first_ip)
+	{
+		printf("%d devices from %s:%d\n", device_count, first_ip, first_port);
+	}
+	else
+	{
+		printf("%d devices on 127.0.0.1:%d-%d\n", device_count, first_port, first_port + device_count - 1);
+	}
+	fflush(stdout);
+
+	int programmed = 0;
+	while(session_limit == 0 || programmed < session_limit)
+	{
+		//wake up for the first device whose flash becomes ready
+		uint64_t now = now_ns();
+		int timeout_ms = 100;
+		for(EmulatedDevice &device : devices)
+		{
+			if(device.fd >= 0 && device.state == PROGRAMMING)
+			{
+				if(device.flash_ready_ns <= now)
+				{
+					update_events(device, now);
+				}
+				else if((device.flash_ready_ns - now) / 1000000 < (uint64_t)timeout_ms)
+				{
+					timeout_ms = (device.flash_ready_ns - now) / 1000000 + 1;
+				}
+			}
+		}
+
+		epoll_event events[256];
+		int count = epoll_wait(epoll_fd, events, 256, timeout_ms);
+		for(int i = 0; i < count; i++)
+		{
+			if(events[i].data.u64 < (uint64_t)device_count)
+			{
+				accept_connection(devices[events[i].data.u64]);
+			}
+			else
+			{
+				handle(*(EmulatedDevice *)events[i].data.ptr, events[i].events);
+			}
+		}
+
+		programmed = 0;
+		for(EmulatedDevice &device : devices)
+		{
+			programmed += device.programmed + device.dumps;
+		}
+	}
+
+	for(EmulatedDevice &device : devices)
+	{
+		printf("%s:%u: %d sessions, %d programmed, %d dumps\n", inet_ntoa(device.ip), device.port, device.sessions,
+			   device.programmed, device.dumps);
+	}
+	return 0;
+}
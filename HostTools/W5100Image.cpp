@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "BootImage.h"
+#include "BootProtocol.h"
+
+//Convert an application image (ELF load segments, Intel HEX or a raw binary) for the boot loader
+//prints the runs of pages that are not erased, which are the segments of a sparse upload, and writes
+//  -b  the padded binary, as sent by PROG
+//  -s  the sparse PROG payload (header, then each segment's descriptor and pages), for sending as it is
+//
+//usage: W5100Image [-b image.bin] [-s image.sparse] image
+
+static bool write_file(const char *path, const void *data, size_t length)
+{
+	FILE *file = fopen(path, "wb");
+	if(!file || fwrite(data, 1, length, file) != length || fclose(file) != 0)
+	{
+		perror(path);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *binary_path = NULL;
+	const char *sparse_path = NULL;
+	int option;
+
+	while((option = getopt(argc, argv, "b:s:")) != -1)
+	{
+		switch(option)
+		{
+			case 'b':
+				binary_path = optarg;
+				break;
+			case 's':
+				sparse_path = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-b image.bin] [-s image.sparse] image\n", argv[0]);
+				return 1;
+		}
+	}
+	if(optind + 1 != argc)
+	{
+		fprintf(stderr, "usage: %s [-b image.bin] [-s image.sparse] image\n", argv[0]);
+		return 1;
+	}
+
+	BootImage image;
+	if(!boot_image_load(argv[optind], image))
+	{
+		return 1;
+	}
+	BootSparse sparse;
+	boot_image_sparse(image, sparse);
+
+	uint32_t sent = 0;
+	printf("Segment  Start    End      Pages\n");
+	for(size_t i = 0; i < sparse.segments.size(); i++)
+	{
+		const BootSegment &segment = sparse.segments[i];
+		printf("%7zu  0x%05X  0x%05X  %5u\n", i, segment.start * BOOT_PAGE_SIZE,
+			   (segment.start + segment.pages) * BOOT_PAGE_SIZE - 1, segment.pages);
+		sent += segment.pages;
+	}
+	printf("%u of %u pages sent, %u erased, image CRC %08X, sparse CRC %08X\n",
+		   sent, image.pages, image.pages - sent, image.crc, sparse.crc);
+
+	if(binary_path && !write_file(binary_path, image.data.data(), image.data.size()))
+	{
+		return 1;
+	}
+	if(sparse_path && !write_file(sparse_path, sparse.stream.data(), sparse.stream.size()))
+	{
+		return 1;
+	}
+	return 0;
+}
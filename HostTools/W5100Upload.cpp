@@ -0,0 +1,618 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "BootImage.h"
+#include "BootProtocol.h"
+
+//Upload one application image to many boot loaders at once
+//every device gets a non-blocking connection driven from a single epoll loop, with its own state machine
+//that follows the boot loader's (WAIT_START -> HEADER/PROGRAMMING -> VERIFY -> OK)
+//the pages are written as fast as the socket accepts them, and the send buffer is kept to about the size
+//of the W5100's receive memory so no more than a window of pages is queued per device. The VERIFY echo is
+//compared as it arrives, or with -c the device only returns a CRC32 of the whole image.
+//with -s only the runs of pages that are not erased are sent (HEADER_SEGMENTS), the device erases the gaps
+//and always returns the image CRC. The image can be a raw binary, Intel HEX or an ELF file.
+//with -S every device is asked for its performance counters (STAT) before OK, and where its time went
+//is printed under its line. Failed devices are retried, then a line per device and the totals for the run are printed
+//
+//usage: W5100Upload [-c] [-s] [-S] [-j max_active] [-r retries] [-t timeout_s] [-w window] [-f hosts_file] image [host[:port] ...]
+
+#define DEFAULT_MAX_ACTIVE 256
+#define DEFAULT_RETRIES 2
+#define DEFAULT_TIMEOUT_S 15		//no progress for this long fails the attempt, the device gives up after 10s
+#define DEFAULT_WINDOW 8192			//socket 0 gets all 8KB of the W5100 RX memory
+#define RETRY_DELAY_NS 2000000000ULL
+
+enum class State
+{
+	Queued,			//waiting for a connection slot or for the retry delay
+	Connecting,
+	WaitStart,		//PROG sent, waiting for the version reply
+	Programming,	//sending the header and the pages
+	Verify,			//comparing the echo or the image CRC
+	Stat,			//reading the performance counters
+	Ok,				//sending OK
+	Done,
+	Failed
+};
+
+static const char *state_names[] = {"queued", "connecting", "WAIT_START", "PROGRAMMING", "VERIFY", "STAT", "OK", "done", "failed"};
+
+struct Image : BootImage
+{
+	uint8_t header[4];
+	bool crc_verify;
+	bool sparse;
+	BootSparse segments;		//the whole upload when sparse
+};
+
+struct Device
+{
+	std::string name;
+	sockaddr_storage address;
+	socklen_t address_length;
+
+	State state = State::Queued;
+	int fd = -1;
+	int attempts = 0;
+	std::string error;
+
+	//outgoing data, at most two pieces (the header and the image)
+	iovec out[2];
+	int out_count = 0;
+
+	uint8_t reply[BOOT_VERSION_LENGTH];
+	size_t reply_length = 0;
+	size_t verified = 0;		//echo bytes compared, or CRC bytes received
+	uint8_t stat[BOOT_STAT_LENGTH];
+	size_t stat_length = 0;
+
+	uint64_t retry_ns = 0;
+	uint64_t attempt_ns = 0;	//start of the current attempt
+	uint64_t progress_ns = 0;	//last time data moved
+	uint64_t end_ns = 0;
+	uint64_t bytes_sent = 0;
+	uint64_t bytes_received = 0;
+};
+
+static Image image;
+static int epoll_fd;
+static int max_active = DEFAULT_MAX_ACTIVE;
+static int retries = DEFAULT_RETRIES;
+static uint64_t timeout_ns = DEFAULT_TIMEOUT_S * 1000000000ULL;
+static int window = DEFAULT_WINDOW;
+static bool want_stats;
+static int active;
+
+static uint64_t now_ns(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void close_device(Device &device)
+{
+	if(device.fd >= 0)
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, device.fd, NULL);
+		close(device.fd);
+		device.fd = -1;
+		active--;
+	}
+}
+
+static void fail(Device &device, const std::string &message)
+{
+	close_device(device);
+	device.error = std::string(state_names[(int)device.state]) + ": " + message;
+	device.end_ns = now_ns();
+	if(device.attempts <= retries)
+	{
+		device.state = State::Queued;
+		device.retry_ns = device.end_ns + RETRY_DELAY_NS;
+	}
+	else
+	{
+		device.state = State::Failed;
+	}
+}
+
+static void queue(Device &device, const void *data, size_t length)
+{
+	device.out[device.out_count].iov_base = (void *)data;
+	device.out[device.out_count].iov_len = length;
+	device.out_count++;
+}
+
+static bool flush(Device &device)
+{
+	//write until everything queued has gone or the socket is full, returns false on error
+	while(device.out_count > 0)
+	{
+		ssize_t written = writev(device.fd, device.out, device.out_count);
+		if(written < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return true;
+			}
+			fail(device, strerror(errno));
+			return false;
+		}
+		device.bytes_sent += written;
+		device.progress_ns = now_ns();
+		while(written > 0)
+		{
+			size_t step = (size_t)written < device.out[0].iov_len ? (size_t)written : device.out[0].iov_len;
+			device.out[0].iov_base = (uint8_t *)device.out[0].iov_base + step;
+			device.out[0].iov_len -= step;
+			written -= step;
+			if(device.out[0].iov_len == 0)
+			{
+				device.out[0] = device.out[1];
+				device.out_count--;
+			}
+		}
+	}
+	return true;
+}
+
+static void start(Device &device)
+{
+	device.attempts++;
+	device.attempt_ns = device.progress_ns = now_ns();
+	device.out_count = 0;
+	device.reply_length = 0;
+	device.verified = 0;
+	device.stat_length = 0;
+
+	device.fd = socket(device.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(device.fd < 0)
+	{
+		fail(device, strerror(errno));
+		return;
+	}
+	active++;
+
+	//a small send buffer keeps about one device window of pages in flight instead of the whole image
+	setsockopt(device.fd, SOL_SOCKET, SO_SNDBUF, &window, sizeof(window));
+	int one = 1;
+	setsockopt(device.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = &device;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, device.fd, &event);
+
+	device.state = State::Connecting;
+	if(connect(device.fd, (sockaddr *)&device.address, device.address_length) < 0 && errno != EINPROGRESS)
+	{
+		fail(device, strerror(errno));
+	}
+}
+
+static bool receive(Device &device, const uint8_t *data, size_t length)
+{
+	//handle bytes from the device, returns false once the attempt has failed
+	for(size_t i = 0; i < length; i++)
+	{
+		switch(device.state)
+		{
+			case State::WaitStart:
+			{
+				device.reply[device.reply_length++] = data[i];
+				if(device.reply_length == BOOT_VERSION_LENGTH)
+				{
+					if(memcmp(device.reply, BOOT_VERSION_REPLY, BOOT_VERSION_LENGTH) != 0)
+					{
+						fail(device, "unexpected version reply");
+						return false;
+					}
+					if(image.sparse)
+					{
+						queue(device, image.segments.stream.data(), image.segments.stream.size());
+					}
+					else
+					{
+						queue(device, image.header, sizeof(image.header));
+						queue(device, image.data.data(), image.data.size());
+					}
+					device.state = State::Programming;
+				}
+				break;
+			}
+			case State::Programming:
+			case State::Verify:
+			{
+				//the echo can only start once every page has been received, but it may be read
+				//in the same pass that sent the last of them
+				if(image.crc_verify)
+				{
+					device.reply[device.verified++] = data[i];
+					if(device.verified == 4)
+					{
+						uint32_t crc = device.reply[0] | (device.reply[1] << 8) | (device.reply[2] << 16) |
+									   ((uint32_t)device.reply[3] << 24);
+						uint32_t expected = image.sparse ? image.segments.crc : image.crc;
+						if(crc != expected)
+						{
+							char message[64];
+							snprintf(message, sizeof(message), "image CRC %08X, expected %08X", crc, expected);
+							fail(device, message);
+							return false;
+						}
+					}
+				}
+				else
+				{
+					if(data[i] != image.data[device.verified])
+					{
+						char message[64];
+						snprintf(message, sizeof(message), "verify mismatch at 0x%05zX", device.verified);
+						fail(device, message);
+						return false;
+					}
+					device.verified++;
+				}
+
+				if(device.verified == (image.crc_verify ? 4 : image.data.size()))
+				{
+					if(want_stats)
+					{
+						queue(device, "STAT", 4);
+						device.state = State::Stat;
+						break;
+					}
+					queue(device, "OK", 2);
+					device.state = State::Ok;
+				}
+				break;
+			}
+			case State::Stat:
+			{
+				device.stat[device.stat_length++] = data[i];
+				if(device.stat_length == BOOT_STAT_LENGTH)
+				{
+					if(device.stat[0] != BOOT_STAT_VERSION || device.stat[1] != BOOT_STAT_LENGTH)
+					{
+						fail(device, "unexpected STAT record");
+						return false;
+					}
+					queue(device, "OK", 2);
+					device.state = State::Ok;
+				}
+				break;
+			}
+			default:
+			{
+				fail(device, "unexpected data");
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static uint32_t stat_counter(const Device &device, int index)
+{
+	const uint8_t *d = &device.stat[4 + index * 4];
+	return d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+static void print_stats(const Device &device)
+{
+	//the device's view of its last attempt, times in ms
+	double tick_ms = (device.stat[2] | (device.stat[3] << 8)) / 1e3;
+	printf("%24s %u SPI frames, %u bytes in, %u out, %u pages programmed, %u erased\n", "",
+		   stat_counter(device, BOOT_STAT_SPI_FRAMES), stat_counter(device, BOOT_STAT_RX_BYTES),
+		   stat_counter(device, BOOT_STAT_TX_BYTES), stat_counter(device, BOOT_STAT_PAGES_PROGRAMMED),
+		   stat_counter(device, BOOT_STAT_PAGES_ERASED));
+	printf("%24s run %.1f ms: waiting for rx %.1f, tx %.1f, flash %.1f; erase %.1f, write %.1f, read back %.1f\n", "",
+		   stat_counter(device, BOOT_STAT_RUN_TICKS) * tick_ms, stat_counter(device, BOOT_STAT_RX_WAIT_TICKS) * tick_ms,
+		   stat_counter(device, BOOT_STAT_TX_WAIT_TICKS) * tick_ms, stat_counter(device, BOOT_STAT_FLASH_WAIT_TICKS) * tick_ms,
+		   stat_counter(device, BOOT_STAT_ERASE_TICKS) * tick_ms, stat_counter(device, BOOT_STAT_WRITE_TICKS) * tick_ms,
+		   stat_counter(device, BOOT_STAT_READBACK_TICKS) * tick_ms);
+}
+
+static void handle(Device &device, uint32_t events)
+{
+	if(device.state == State::Connecting)
+	{
+		int error = 0;
+		socklen_t length = sizeof(error);
+		getsockopt(device.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+		if(error)
+		{
+			fail(device, strerror(error));
+			return;
+		}
+		if(!(events & EPOLLOUT))
+		{
+			return;
+		}
+		queue(device, "PROG", 4);
+		device.state = State::WaitStart;
+	}
+
+	//edge triggered, so read until the socket is empty
+	uint8_t buffer[16384];
+	while(true)
+	{
+		ssize_t length = recv(device.fd, buffer, sizeof(buffer), 0);
+		if(length > 0)
+		{
+			device.bytes_received += length;
+			device.progress_ns = now_ns();
+			if(!receive(device, buffer, length))
+			{
+				return;
+			}
+			continue;
+		}
+		if(length == 0)
+		{
+			fail(device, "connection closed by the device");
+			return;
+		}
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			fail(device, strerror(errno));
+			return;
+		}
+		break;
+	}
+
+	if(!flush(device))
+	{
+		return;
+	}
+	if(device.out_count == 0)
+	{
+		if(device.state == State::Programming)
+		{
+			device.state = State::Verify;
+		}
+		else if(device.state == State::Ok)
+		{
+			//the boot loader stores the Programmed flag and jumps to the application
+			close_device(device);
+			device.state = State::Done;
+			device.end_ns = now_ns();
+		}
+	}
+}
+
+static bool load_image(const char *path, bool crc_verify, bool sparse)
+{
+	if(!boot_image_load(path, image))
+	{
+		return false;
+	}
+	image.sparse = sparse;
+	image.crc_verify = crc_verify || sparse;
+	if(sparse)
+	{
+		boot_image_sparse(image, image.segments);
+		printf("%zu segments, %zu of %u pages sent\n", image.segments.segments.size(),
+			   (image.segments.stream.size() - 4 - image.segments.segments.size() * 4) / BOOT_PAGE_SIZE, image.segments.pages);
+	}
+	image.header[0] = image.pages & 0xFF;
+	image.header[1] = (image.pages >> 8) & 0xFF;
+	image.header[2] = (image.pages >> 16) & 0xFF;
+	image.header[3] = crc_verify ? BOOT_HEADER_VERIFY_CRC : 0;
+	return true;
+}
+
+static bool add_device(std::vector<Device> &devices, const std::string &target)
+{
+	std::string host = target;
+	std::string port = std::to_string(BOOT_PORT);
+	size_t colon = target.rfind(':');
+	if(colon != std::string::npos)
+	{
+		host = target.substr(0, colon);
+		port = target.substr(colon + 1);
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *result;
+	int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+	if(error)
+	{
+		fprintf(stderr, "%s: %s\n", target.c_str(), gai_strerror(error));
+		return false;
+	}
+
+	Device device;
+	device.name = target;
+	memcpy(&device.address, result->ai_addr, result->ai_addrlen);
+	device.address_length = result->ai_addrlen;
+	freeaddrinfo(result);
+	devices.push_back(device);
+	return true;
+}
+
+static bool read_hosts(std::vector<Device> &devices, const char *path)
+{
+	//one host[:port] per line, blank lines and # comments are skipped
+	FILE *file = fopen(path, "r");
+	if(!file)
+	{
+		perror(path);
+		return false;
+	}
+	char line[256];
+	bool ok = true;
+	while(fgets(line, sizeof(line), file))
+	{
+		char *end = line + strcspn(line, "#\r\n");
+		while(end > line && (end[-1] == ' ' || end[-1] == '\t'))
+		{
+			end--;
+		}
+		*end = 0;
+		char *begin = line + strspn(line, " \t");
+		if(*begin && !add_device(devices, begin))
+		{
+			ok = false;
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	bool crc_verify = false;
+	bool sparse = false;
+	std::vector<Device> devices;
+	int option;
+
+	while((option = getopt(argc, argv, "csSj:r:t:w:f:")) != -1)
+	{
+		switch(option)
+		{
+			case 'c':
+				crc_verify = true;
+				break;
+			case 's':
+				sparse = true;
+				break;
+			case 'S':
+				want_stats = true;
+				break;
+			case 'j':
+				max_active = atoi(optarg);
+				break;
+			case 'r':
+				retries = atoi(optarg);
+				break;
+			case 't':
+				timeout_ns = strtoull(optarg, NULL, 10) * 1000000000ULL;
+				break;
+			case 'w':
+				window = atoi(optarg);
+				break;
+			case 'f':
+				if(!read_hosts(devices, optarg))
+				{
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-c] [-s] [-S] [-j max_active] [-r retries] [-t timeout_s] [-w window] [-f hosts_file] "
+						"image [host[:port] ...]\n", argv[0]);
+				return 2;
+		}
+	}
+	if(optind >= argc || max_active < 1)
+	{
+		fprintf(stderr, "usage: %s [-c] [-s] [-S] [-j max_active] [-r retries] [-t timeout_s] [-w window] [-f hosts_file] "
+				"image [host[:port] ...]\n", argv[0]);
+		return 2;
+	}
+	if(!load_image(argv[optind], crc_verify, sparse))
+	{
+		return 1;
+	}
+	for(int i = optind + 1; i < argc; i++)
+	{
+		if(!add_device(devices, argv[i]))
+		{
+			return 1;
+		}
+	}
+	if(devices.empty())
+	{
+		fprintf(stderr, "%s: no devices given\n", argv[0]);
+		return 2;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	uint64_t run_start = now_ns();
+	size_t finished = 0;
+
+	while(finished < devices.size())
+	{
+		uint64_t now = now_ns();
+
+		//start devices while there are free slots
+		for(Device &device : devices)
+		{
+			if(active >= max_active)
+			{
+				break;
+			}
+			if(device.state == State::Queued && device.retry_ns <= now)
+			{
+				start(device);
+			}
+		}
+
+		epoll_event events[256];
+		int count = epoll_wait(epoll_fd, events, 256, 50);
+		for(int i = 0; i < count; i++)
+		{
+			handle(*(Device *)events[i].data.ptr, events[i].events);
+		}
+
+		//fail attempts that stopped making progress
+		now = now_ns();
+		finished = 0;
+		for(Device &device : devices)
+		{
+			if(device.fd >= 0 && now - device.progress_ns > timeout_ns)
+			{
+				fail(device, "timed out");
+			}
+			if(device.state == State::Done || device.state == State::Failed)
+			{
+				finished++;
+			}
+		}
+	}
+	double run_s = (now_ns() - run_start) / 1e9;
+
+	printf("%-24s %6s %8s %10s %9s  %s\n", "Device", "", "Attempts", "Time ms", "KB/s", "Last error");
+	int ok_count = 0;
+	for(Device &device : devices)
+	{
+		double attempt_s = (device.end_ns - device.attempt_ns) / 1e9;
+		bool ok = device.state == State::Done;
+		ok_count += ok;
+		printf("%-24s %6s %8d %10.1f %9.1f  %s\n", device.name.c_str(), ok ? "ok" : "FAIL", device.attempts,
+			   attempt_s * 1e3, ok ? image.data.size() / attempt_s / 1e3 : 0.0, device.error.c_str());
+		if(ok && device.stat_length == BOOT_STAT_LENGTH)
+		{
+			print_stats(device);
+		}
+	}
+
+	uint64_t bytes_moved = 0;
+	for(Device &device : devices)
+	{
+		bytes_moved += device.bytes_sent + device.bytes_received;
+	}
+	printf("%d of %zu devices programmed, %u pages (%s verify), %.1f s, %.1f KB/s of images, %.1f KB/s on the wire\n",
+		   ok_count, devices.size(), image.pages, image.crc_verify ? "CRC" : "echo", run_s,
+		   ok_count * image.data.size() / run_s / 1e3, bytes_moved / run_s / 1e3);
+	return ok_count == (int)devices.size() ? 0 : 1;
+}
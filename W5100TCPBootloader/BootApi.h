@@ -0,0 +1,153 @@
+
+#ifndef BOOTAPI_H_
+#define BOOTAPI_H_
+
+#include <stdint.h>
+
+//Boot loader functions an application can call while it is running, for staged updates, and the boot loader's
+//W5100 block transfers, flash page programming and network settings, so an application needs no copies of its own
+//
+//The application receives a new image (by whatever means it likes) into the staging area, the upper half of
+//the application section, one page at a time with boot_stage_page, then records the page count and CRC32 of
+//the image with boot_stage_commit and resets. At the next reset the boot loader checks the staged image against
+//the CRC and copies it over the application before starting it, so the application is only down for the copy.
+//An application that uses staging must fit below BOOT_STAGE_START_PAGE. Staging is a build option of the boot loader
+//(BOOT_STAGE, see BootConfig.h), one built without it refuses every staged page and commit.
+//
+//SPM only works from the boot section, so the functions live there, reached through a table of jmp instructions
+//at a fixed address at the top of the boot section (the .bootapi section, see the linker settings of the project).
+//The ones that write the flash or EEPROM run with interrupts off until the write is done, the application's vectors
+//are in the RWW section, which can't be read while it is programmed. They all only use the stack, never the boot
+//loader's variables, which share SRAM with the application
+//
+//The table has grown since the first version (the staging functions), check boot_api_version before calling
+//anything else, a boot loader from before it has erased flash where the other entries are now
+
+#define BOOT_API_ADDRESS 0x3FFE0UL						//byte address of the table, .bootapi = 0x1FFF0 (words)
+#define BOOT_API_STAGE_PAGE (BOOT_API_ADDRESS + 0)
+#define BOOT_API_STAGE_COMMIT (BOOT_API_ADDRESS + 4)
+#define BOOT_API_W5100_READ (BOOT_API_ADDRESS + 8)		//version 1 and later
+#define BOOT_API_W5100_WRITE (BOOT_API_ADDRESS + 12)
+#define BOOT_API_PROGRAM_PAGE (BOOT_API_ADDRESS + 16)
+#define BOOT_API_READ_PAGE (BOOT_API_ADDRESS + 20)
+#define BOOT_API_NETWORK_CONFIG (BOOT_API_ADDRESS + 24)
+#define BOOT_API_VERSION_WORD (BOOT_API_ADDRESS + 28)	//the version, a word of data after the last entry
+
+#define BOOT_API_VERSION 1
+#define BOOT_API_NETWORK_CONFIG_LENGTH 18				//gateway IP, subnet mask, MAC address and device IP, as IPST sends them
+
+#define BOOT_STAGE_START_PAGE 496		//first page of the staging area (0x1F000), the application section is 992 pages
+#define BOOT_STAGE_PAGES 496
+
+#if defined(__AVR__) && !defined(BOOT_API_IMPLEMENTATION)
+
+#include <avr/pgmspace.h>
+
+//The version of the table, 0 for a boot loader that only has the staging functions
+static inline uint16_t boot_api_version(void)
+{
+	uint16_t version = pgm_read_word_far(BOOT_API_VERSION_WORD);
+	return version == 0xFFFF ? 0 : version;
+}
+
+//Program page index (0 to BOOT_STAGE_PAGES - 1) of the staging area from the 256 bytes at buf,
+//returns 0 for an index outside the staging area. Blocks for the erase and write, about 9ms
+static inline uint8_t boot_stage_page(uint16_t index, const uint8_t *buf)
+{
+	register uint16_t r24 __asm__("r24") = index;
+	register const uint8_t *r22 __asm__("r22") = buf;
+	__asm__ volatile ("call %[entry]"
+					  : "+r" (r24), "+r" (r22)
+					  : [entry] "i" (BOOT_API_STAGE_PAGE)
+					  : "r0", "r18", "r19", "r20", "r21", "r26", "r27", "r30", "r31", "memory");
+	return r24 & 0xFF;
+}
+
+//Record a staged image of pages pages with crc, the CRC32 of those pages (see Crc32.h), for the boot loader to
+//install at the next reset. 0 pages cancels a staged image. Returns 0 if pages is more than the staging area holds
+static inline uint8_t boot_stage_commit(uint16_t pages, uint32_t crc)
+{
+	register uint16_t r24 __asm__("r24") = pages;
+	register uint32_t r20 __asm__("r20") = crc;
+	__asm__ volatile ("call %[entry]"
+					  : "+r" (r24), "+r" (r20)
+					  : [entry] "i" (BOOT_API_STAGE_COMMIT)
+					  : "r0", "r18", "r19", "r26", "r27", "r30", "r31", "memory");
+	return r24 & 0xFF;
+}
+
+//Read length bytes of W5100 memory (registers or socket buffers) from address into buf, and write them from data,
+//with the boot loader's driver (WiznetW5100.h, wiznet_read_block and wiznet_write_block), one SPI frame per byte.
+//SPI and the chip select on PB4 must be set up, as the boot loader leaves them with WarmHandoff (BootHandoff.h)
+static inline void boot_w5100_read(uint16_t address, uint8_t *buf, uint16_t length)
+{
+	register uint16_t r24 __asm__("r24") = address;
+	register uint8_t *r22 __asm__("r22") = buf;
+	register uint16_t r20 __asm__("r20") = length;
+	__asm__ volatile ("call %[entry]"
+					  : "+r" (r24), "+r" (r22), "+r" (r20)
+					  : [entry] "i" (BOOT_API_W5100_READ)
+					  : "r0", "r18", "r19", "r26", "r27", "r30", "r31", "memory");
+}
+
+static inline void boot_w5100_write(uint16_t address, const uint8_t *data, uint16_t length)
+{
+	register uint16_t r24 __asm__("r24") = address;
+	register const uint8_t *r22 __asm__("r22") = data;
+	register uint16_t r20 __asm__("r20") = length;
+	__asm__ volatile ("call %[entry]"
+					  : "+r" (r24), "+r" (r22), "+r" (r20)
+					  : [entry] "i" (BOOT_API_W5100_WRITE)
+					  : "r0", "r18", "r19", "r26", "r27", "r30", "r31", "memory");
+}
+
+//Program page (a page of the application section, below the boot loader) from the 256 bytes at buf, returns 0 for a
+//page outside it. Like boot_stage_page it blocks for the erase and write, the caller must not overwrite the code it
+//is running or will return to
+static inline uint8_t boot_program_page(uint16_t page, const uint8_t *buf)
+{
+	register uint16_t r24 __asm__("r24") = page;
+	register const uint8_t *r22 __asm__("r22") = buf;
+	__asm__ volatile ("call %[entry]"
+					  : "+r" (r24), "+r" (r22)
+					  : [entry] "i" (BOOT_API_PROGRAM_PAGE)
+					  : "r0", "r18", "r19", "r20", "r21", "r26", "r27", "r30", "r31", "memory");
+	return r24 & 0xFF;
+}
+
+//Read flash page page (anywhere in the flash) into the 256 bytes at buf, returns 0 for a page past the end
+static inline uint8_t boot_read_page(uint16_t page, uint8_t *buf)
+{
+	register uint16_t r24 __asm__("r24") = page;
+	register uint8_t *r22 __asm__("r22") = buf;
+	__asm__ volatile ("call %[entry]"
+					  : "+r" (r24), "+r" (r22)
+					  : [entry] "i" (BOOT_API_READ_PAGE)
+					  : "r0", "r18", "r19", "r20", "r21", "r26", "r27", "r30", "r31", "memory");
+	return r24 & 0xFF;
+}
+
+//Read the network settings the boot loader keeps in EEPROM into the BOOT_API_NETWORK_CONFIG_LENGTH bytes at config,
+//or with write set, store them from there. Stored settings are used from the next reset
+static inline void boot_network_config(uint8_t *config, uint8_t write)
+{
+	register uint8_t *r24 __asm__("r24") = config;
+	register uint8_t r22 __asm__("r22") = write;
+	__asm__ volatile ("call %[entry]"
+					  : "+r" (r24), "+r" (r22)
+					  : [entry] "i" (BOOT_API_NETWORK_CONFIG)
+					  : "r0", "r18", "r19", "r20", "r21", "r23", "r26", "r27", "r30", "r31", "memory");
+}
+
+#else
+
+//the boot loader side, also called directly by a host build
+uint8_t boot_api_stage_page(uint16_t index, const uint8_t *buf);
+uint8_t boot_api_stage_commit(uint16_t pages, uint32_t crc);
+uint8_t boot_api_program_page(uint16_t page, const uint8_t *buf);
+uint8_t boot_api_read_page(uint16_t page, uint8_t *buf);
+void boot_api_network_config(uint8_t *config, uint8_t write);
+
+#endif
+
+#endif /* BOOTAPI_H_ */
@@ -0,0 +1,36 @@
+
+#ifndef BOOTCONFIG_H_
+#define BOOTCONFIG_H_
+
+//Build options of the boot loader, each can be set on the compiler command line (OPTIONS in the Makefile)
+//
+//Everything has to fit the 8KB boot section (BOOTSZ 4096 words) below the API table at 0x3FFE0, 8160 bytes.
+//The base loader (PROG, STAT and IPST) is about 7120 bytes, so each mode below is left out unless a build asks
+//for it, and no more than two fit, DLTA with any other with room to spare. The sizes are what each option adds to
+//the linked loader (-Os, --gc-sections from main, the ISRs and the API table), measured with the host compiler
+//and scaled by its ratio to avr-gcc on the base loader, so check the real map before enabling two.
+//Modes that could not fit next to the base loader on their own were removed rather than kept behind a flag.
+//HostSim builds them all together (make FULL=1) to benchmark them, which is larger than the boot section
+
+//Delta uploads (DLTA), about 270 bytes
+#ifndef BOOT_DELTA
+#define BOOT_DELTA 0
+#endif
+
+//Sparse images (HEADER_SEGMENTS), about 490 bytes. A build without them drops the connection when the flag is set
+#ifndef BOOT_SEGMENTS
+#define BOOT_SEGMENTS 0
+#endif
+
+//Staged updates, about 540 bytes: the staging entries of the API table (BootApi.h) and the install at reset.
+//Without them the table keeps its layout and boot_stage_page and boot_stage_commit return 0
+#ifndef BOOT_STAGE
+#define BOOT_STAGE 0
+#endif
+
+//Flash dumps (DUMP), about 450 bytes
+#ifndef BOOT_DUMP
+#define BOOT_DUMP 0
+#endif
+
+#endif /* BOOTCONFIG_H_ */
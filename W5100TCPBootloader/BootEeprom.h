@@ -0,0 +1,48 @@
+
+#ifndef BOOTEEPROM_H_
+#define BOOTEEPROM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "BootHandoff.h"
+
+//Layout of the boot loader's EEPROM
+//
+//The boot loader keeps everything it stores in EEPROM in one EEMEM block (Eeprom in W5100TCPBootloader.c), so the
+//compiler and linker can't reorder the values: applications write EnterBootloader and WarmHandoff by address.
+//The offsets are checked below, and the Makefile checks the block is at EEPROM address 0 in the linked boot loader.
+//New values go at the end, the ones in use never move
+
+//Staged image for the next reset, written by boot_api_stage_commit, see BootApi.h
+//the magic is written last and cleared once the image is installed
+#define STAGE_MAGIC 0x5A
+typedef struct
+{
+	uint8_t magic;
+	uint16_t pages;
+	uint32_t crc;
+} __attribute__((packed)) StageManifest;
+
+typedef struct
+{
+	unsigned char Programmed;			//set once an application has been verified, 0 until the first upload
+	unsigned char GateWayIP[4];			//TCP/IP connection setup, as IPST sends it
+	unsigned char SubNetMask[4];
+	unsigned char MacAddress[6];
+	unsigned char DeviceIPAddress[4];
+	unsigned char EnterBootloader;		//non zero from an application that wants the boot loader at the next reset
+	StageManifest Stage;
+	unsigned char Reserved[63];			//were the progress records of resumable transfers
+	unsigned char WarmHandoff;			//non zero from an application that wants the W5100 handed over configured
+} __attribute__((packed)) BootEeprom;
+
+#define BOOT_EEPROM_ENTER 19			//EEPROM address of EnterBootloader, write non zero to get the boot loader at the next reset
+
+_Static_assert(offsetof(BootEeprom, GateWayIP) == 1, "the network settings moved in EEPROM");
+_Static_assert(offsetof(BootEeprom, DeviceIPAddress) == 15, "the network settings moved in EEPROM");
+_Static_assert(offsetof(BootEeprom, EnterBootloader) == BOOT_EEPROM_ENTER, "EnterBootloader moved in EEPROM");
+_Static_assert(offsetof(BootEeprom, Stage) == 20, "the staging manifest moved in EEPROM");
+_Static_assert(offsetof(BootEeprom, WarmHandoff) == BOOT_HANDOFF_EEPROM_WARM, "WarmHandoff moved in EEPROM");
+
+#endif /* BOOTEEPROM_H_ */
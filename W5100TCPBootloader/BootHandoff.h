@@ -0,0 +1,100 @@
+
+#ifndef BOOTHANDOFF_H_
+#define BOOTHANDOFF_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Boot loader to application handoff
+//
+//Every time the boot loader starts the application it leaves a handoff block near the top of SRAM, with the
+//network configuration it read from EEPROM and why it started the application. An application that has set the
+//WarmHandoff EEPROM byte (BOOT_HANDOFF_EEPROM_WARM, see BootEeprom.h) is also handed the W5100 still
+//configured: the boot loader closes its sockets but leaves the chip's network settings and socket memory layout,
+//the SPI registers and the SPI and W5100 chip select pins (PB0-PB4) as they are, and sets BOOT_HANDOFF_W5100_READY.
+//The application then needs no reset and configuration of the chip of its own. Without WarmHandoff the SPI and
+//the ports are reset as before. A fast boot (no update requested) starts the application without touching the
+//W5100, so it is never ready then.
+//
+//The block is 64 bytes below the end of SRAM, where the application's stack starts. Like the boot request
+//mailbox, the application must take it before anything is pushed onto the stack, from a naked function in
+//.init3 (boot_handoff_take, with optimisation on so it is inlined), into a variable in .noinit:
+//
+//	BootHandoff Handoff __attribute__((section(".noinit")));
+//	void handoff_read (void) __attribute__((naked, used, section(".init3")));
+//	void handoff_read (void) { boot_handoff_take(&Handoff); }
+//
+//and then check Handoff.magic (cleared by boot_handoff_take if the block was not valid)
+
+#define BOOT_HANDOFF_MAGIC 0xB0A7
+#define BOOT_HANDOFF_VERSION 1
+#define BOOT_HANDOFF_EEPROM_WARM 90		//EEPROM address of WarmHandoff, write non zero to be handed the W5100
+
+//why the boot loader started the application
+#define BOOT_EXIT_FAST_BOOT 0			//no update was requested, the W5100 has not been touched
+#define BOOT_EXIT_STAGED 1				//a staged image was installed (BootApi.h), the W5100 has not been touched
+#define BOOT_EXIT_TIMEOUT 2				//nothing was programmed, the 10 second timeout ran out or the connection was lost
+#define BOOT_EXIT_PROGRAMMED 3			//a new image was programmed and verified
+#define BOOT_EXIT_IPSET 4				//the network configuration was changed (IPST), the block holds the new one
+
+//flags
+#define BOOT_HANDOFF_W5100_READY 0x01	//the W5100 is configured with the addresses below and its sockets are closed
+
+typedef struct
+{
+	uint16_t magic;					//BOOT_HANDOFF_MAGIC
+	uint8_t version;				//BOOT_HANDOFF_VERSION
+	uint8_t length;					//sizeof(BootHandoff), later versions only add to the end
+	uint8_t reason;					//BOOT_EXIT_
+	uint8_t flags;					//BOOT_HANDOFF_
+	uint8_t gateway_ip[4];
+	uint8_t subnet_mask[4];
+	uint8_t mac_address[6];
+	uint8_t device_ip_address[4];
+	uint8_t rx_layout;				//RMSR and TMSR (WIZNET_MEM_LAYOUT), valid with BOOT_HANDOFF_W5100_READY
+	uint8_t tx_layout;
+	uint8_t socket_status[4];		//Sn_SR of each socket, valid with BOOT_HANDOFF_W5100_READY
+	uint8_t check;					//XOR of all the bytes before it
+} BootHandoff;
+
+#define BOOT_HANDOFF_ADDRESS (RAMEND + 1 - 64)
+
+static inline uint8_t boot_handoff_check(const volatile BootHandoff *handoff)
+{
+	const volatile uint8_t *byte = (const volatile uint8_t *)handoff;
+	uint8_t check = 0;
+	for(uint8_t i = 0; i < offsetof(BootHandoff, check); i++)
+	{
+		check ^= byte[i];
+	}
+	return check;
+}
+
+#if defined(__AVR__) && !defined(BOOT_HANDOFF_IMPLEMENTATION)
+
+#include <avr/io.h>
+
+//copy the handoff block into handoff and clear it, so it is not taken again after a reset that did not go
+//through the boot loader, returns 1 if it was valid. handoff.magic is 0 if not
+static inline uint8_t boot_handoff_take(BootHandoff *handoff)
+{
+	volatile BootHandoff *block = (volatile BootHandoff *)BOOT_HANDOFF_ADDRESS;
+	uint8_t *to = (uint8_t *)handoff;
+	const volatile uint8_t *from = (const volatile uint8_t *)block;
+	for(uint8_t i = 0; i < sizeof(BootHandoff); i++)
+	{
+		to[i] = from[i];
+	}
+	block->magic = 0;
+	if(handoff->magic != BOOT_HANDOFF_MAGIC || handoff->version < 1 || handoff->length < sizeof(BootHandoff) ||
+	   boot_handoff_check(handoff) != handoff->check)
+	{
+		handoff->magic = 0;
+		return 0;
+	}
+	return 1;
+}
+
+#endif
+
+#endif /* BOOTHANDOFF_H_ */
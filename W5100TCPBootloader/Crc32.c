@@ -0,0 +1,33 @@
+#include "Crc32.h"
+
+//CRC of each nibble value, reflected polynomial 0xEDB88320
+//the boot section sits above 64KB where LPM cannot reach, so the table is kept in SRAM (64 bytes),
+//which is cheaper to index than a far flash read and a quarter of the size of a full byte table
+static const uint32_t Crc32Nibble[16] =
+{
+	0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL,
+	0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+	0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL,
+	0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL
+};
+
+uint32_t crc32_update(uint32_t crc, uint8_t data)
+{
+	//two table steps per byte instead of eight shift/xor steps
+	crc ^= data;
+	crc = (crc >> 4) ^ Crc32Nibble[crc & 0x0F];
+	crc = (crc >> 4) ^ Crc32Nibble[crc & 0x0F];
+	return crc;
+}
+
+uint32_t crc32_update_block(uint32_t crc, const uint8_t *data, uint16_t length)
+{
+	//the same for a run of bytes, without a call per byte
+	while(length--)
+	{
+		crc ^= *data++;
+		crc = (crc >> 4) ^ Crc32Nibble[crc & 0x0F];
+		crc = (crc >> 4) ^ Crc32Nibble[crc & 0x0F];
+	}
+	return crc;
+}
@@ -0,0 +1,16 @@
+
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <stdint.h>
+
+//CRC-32 (IEEE 802.3, the same as zip/zlib), used for page digests and the whole image check
+//start from CRC32_INIT, update one byte at a time, then finish with crc32_final
+#define CRC32_INIT 0xFFFFFFFFUL
+
+uint32_t crc32_update(uint32_t crc, uint8_t data);
+uint32_t crc32_update_block(uint32_t crc, const uint8_t *data, uint16_t length);
+
+#define crc32_final(crc) ((crc) ^ 0xFFFFFFFFUL)
+
+#endif /* CRC32_H_ */
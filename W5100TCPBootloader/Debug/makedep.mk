@@ -6,3 +6,5 @@ W5100TCPBootloader.c
 
 WiznetW5100.c
 
+Crc32.c
+
@@ -5,8 +5,52 @@
 #include <avr/pgmspace.h>	//Macros for reading Program Flash memory (pgm_read_byte_far)
 #include <avr/boot.h>		//Boot loader macros
 #include <avr/wdt.h>		//Watchdog Timer macros
+#include <avr/sleep.h>		//Idle sleep while waiting for the W5100
 
 #include "WiznetW5100.h"			//Wiznet W5100 ethernet chip driver functions
+#include "Crc32.h"					//CRC32 for page digests
+#define BOOT_API_IMPLEMENTATION
+#include "BootApi.h"				//staged updates, called by the application
+#define BOOT_HANDOFF_IMPLEMENTATION
+#include "BootHandoff.h"			//network settings and the W5100 handed to the application
+#include "BootConfig.h"				//optional update modes
+#include "BootEeprom.h"				//EEPROM layout
+
+//Option flags in the top byte of the page count in the header
+#define HEADER_VERIFY_CRC 0x01	//VERIFY returns a CRC32 of the whole image instead of the pages
+#define HEADER_SEGMENTS 0x02	//sparse image, the count is of segments instead of pages (see PROGRAMMING)
+
+//Start of the boot section, BOOTSZ 4096 words, the only size the boot loader fits
+#ifndef BOOT_START
+#define BOOT_START 0x3E000UL
+#endif
+#define APP_PAGES (BOOT_START / SPM_PAGESIZE)	//pages of the application section, below the boot loader
+
+//Jump to the application reset vector, a host build (see HostSim) replaces this to end the simulated session
+#ifndef BOOT_JUMP_APPLICATION
+#define BOOT_JUMP_APPLICATION() asm("jmp 0000")
+#endif
+
+//Boot request mailbox, an application asks for the boot loader by writing BOOT_REQUEST_MAGIC to the last
+//2 bytes of SRAM and then resetting through the watchdog. It is read in .init3, before the start up code
+//has pushed anything onto the stack that begins there, a host build (see HostSim) supplies both
+#define BOOT_REQUEST_MAGIC 0xB007
+#ifndef BOOT_MAILBOX
+#define BOOT_MAILBOX (*(volatile uint16_t *)(RAMEND - 1))
+#endif
+#ifndef BOOT_INIT3
+#define BOOT_INIT3 __attribute__((naked, used, section(".init3")))
+#endif
+
+//Handoff block for the application (BootHandoff.h), at the top of SRAM like the mailbox, a host build supplies it
+#ifndef BOOT_HANDOFF_BLOCK
+#define BOOT_HANDOFF_BLOCK ((volatile BootHandoff *)BOOT_HANDOFF_ADDRESS)
+#endif
+
+//Called once per pass of the main loop, a host build uses it to count the CPU time of passes that don't touch the chip
+#ifndef BOOT_LOOP_PASS
+#define BOOT_LOOP_PASS()
+#endif
 
 //Wiznet W5100 chip has 4 available sockets
 //0x0000 socket 0, 0x0100 socket 1, 0x0200 socket 2, 0x0300 socket 3
@@ -21,15 +65,61 @@ unsigned char device_ip_address[4] = {10,0,0,75};
 
 unsigned char Sec_Timeout;
 
-//This EEPROM value is only used to create a EEPROM file that is written to the MCU
-//during programming of the boot loader, this value is NOT initialized when the boot loader starts
-unsigned char EEMEM Programmed = 0x00;
+//W5100 /INT is on PE4 (INT4), pin 2 of the Mega with the Ethernet shield's INT jumper bridged
+//INT is level triggered and stays low until Sn_IR is cleared, the main loop does that over SPI
+//(the ISR could land in the middle of an SPI frame) and then enables INT4 again
+volatile uint8_t WiznetEvent = 1;
+//without the jumper PE4 stays high, the main loop notices when Sn_IR has flags set while it is high and then has
+//the TIMER3 compare interrupt look at the chip every 2ms in place of waiting up to a second for the TIMER1 tick
+#define WIZNET_POLL_TICKS 125
 
-//18 bytes for storing TCP/IP connection setup
-unsigned char EEMEM GateWayIP [4] = {10,0,0,28};
-unsigned char EEMEM SubNetMask [4] = {255,255,255,0};
-unsigned char EEMEM MacAddress [6] = {0xDE,0xAD,0xBE,0xEF,0xFE,0xED};
-unsigned char EEMEM DeviceIPAddress [4] = {10,0,0,75};
+//Performance counters, returned by the STAT command
+//times are ticks of TIMER3, which runs free at clk/256 (16us) next to the TIMER1 second tick,
+//it is never reset so every interval is the difference of two readings, correct up to 1 second long
+#define STAT_TICK_US 16
+#define STAT_RECORD_VERSION 1
+#define STAT_RECORD_LENGTH 52
+#define stat_ticks() ((uint16_t)TCNT3)
+
+typedef struct
+{
+	uint32_t pages_programmed;
+	uint32_t pages_erased;		//erased without being written, the gaps of sparse images
+	uint32_t run_ticks;			//since the boot loader started
+	uint32_t rx_wait_ticks;		//passes of the main loop with nothing to do until the host sends more
+	uint32_t tx_wait_ticks;		//the same while sending, waiting for room in the transmit buffer
+	uint32_t flash_wait_ticks;	//the same while a page erase or write is still busy
+	uint32_t erase_ticks;		//page erases, in the background
+	uint32_t write_ticks;		//page writes, in the background
+	uint32_t readback_ticks;	//reading the flash for echoes, digests and CRCs
+} BootStats;
+BootStats Stats;
+
+//The boot loader's EEPROM (BootEeprom.h). These values are only used to create a EEPROM file that is written to
+//the MCU during programming of the boot loader, they are NOT initialized when the boot loader starts.
+//EnterBootloader is the other way in besides the SRAM mailbox, it survives a power cycle and is cleared once the
+//boot loader has started. WarmHandoff asks for the W5100 to be handed over still configured, see BootHandoff.h
+BootEeprom EEMEM Eeprom =
+{
+	.Programmed = 0x00,
+	.GateWayIP = {10,0,0,28},
+	.SubNetMask = {255,255,255,0},
+	.MacAddress = {0xDE,0xAD,0xBE,0xEF,0xFE,0xED},
+	.DeviceIPAddress = {10,0,0,75},
+	.EnterBootloader = 0x00,
+	.Stage = {0x00, 0, 0},
+	.WarmHandoff = 0x00,
+};
+
+//BOOT_MAILBOX as it was at reset, kept out of the start up code's clearing of .bss
+uint16_t BootRequest __attribute__((section(".noinit")));
+
+void boot_mailbox_read (void) BOOT_INIT3;
+void boot_mailbox_read (void)
+{
+	BootRequest = BOOT_MAILBOX;
+	BOOT_MAILBOX = 0;	//one request per reset
+}
 
 ISR(TIMER1_COMPA_vect)	//One second timer interrupt
 {
@@ -41,63 +131,1284 @@ ISR(TIMER1_COMPA_vect)	//One second timer interrupt
 		PORTB ^= 1 << 7; //flash/toggle the LED each second to signal we are in boot loader mode
 		Sec_Timeout--;
 	}
+	WiznetEvent = 1;	//look at the chip once a second anyway, in case INT is not connected
+}
+
+ISR(TIMER3_COMPA_vect)	//W5100 poll tick, only enabled once INT has been found not to be connected
+{
+	OCR3A = TCNT3 + WIZNET_POLL_TICKS;
+	WiznetEvent = 1;
+}
+
+ISR(INT4_vect)	//W5100 interrupt
+{
+	EIMSK &= ~(1<<INT4);
+	WiznetEvent = 1;
 }
 
 //Write IP settings into EEPROM
 void write_IP_EEPROM(unsigned char gateway_ip[4],unsigned char subnet_mask[4],
 					 unsigned char mac_address[6],unsigned char device_ip_address[4])
 {
-	eeprom_update_block((const void*)gateway_ip , GateWayIP, 4);
-	eeprom_update_block((const void*)subnet_mask , SubNetMask, 4);
-	eeprom_update_block((const void*)mac_address , MacAddress, 6);
-	eeprom_update_block((const void*)device_ip_address , DeviceIPAddress, 4);
+	eeprom_update_block((const void*)gateway_ip , Eeprom.GateWayIP, 4);
+	eeprom_update_block((const void*)subnet_mask , Eeprom.SubNetMask, 4);
+	eeprom_update_block((const void*)mac_address , Eeprom.MacAddress, 6);
+	eeprom_update_block((const void*)device_ip_address , Eeprom.DeviceIPAddress, 4);
 }
 
 //Read IP settings from EEPROM
 void read_IP_EEPROM(unsigned char gateway_ip[4],unsigned char subnet_mask[4],
 					unsigned char mac_address[6], unsigned char device_ip_address[4])
 {
-	eeprom_read_block((void*)gateway_ip , GateWayIP, 4);
-	eeprom_read_block((void*)subnet_mask , SubNetMask, 4);
-	eeprom_read_block((void*)mac_address , MacAddress, 6);
-	eeprom_read_block((void*)device_ip_address , DeviceIPAddress, 4);
+	eeprom_read_block((void*)gateway_ip , Eeprom.GateWayIP, 4);
+	eeprom_read_block((void*)subnet_mask , Eeprom.SubNetMask, 4);
+	eeprom_read_block((void*)mac_address , Eeprom.MacAddress, 6);
+	eeprom_read_block((void*)device_ip_address , Eeprom.DeviceIPAddress, 4);
 }
 
-void boot_program_page (uint32_t page, uint8_t *buf)
+//Background page programming
+//the boot loader runs from the NRWW section, so it can keep executing (and receiving the next page)
+//while an RWW application page is erased and written. The page is loaded into the SPM page buffer first,
+//which frees the callers buffer straight away, then boot_page_ready() steps from erase to write by polling SPMEN
+enum {FLASH_IDLE, FLASH_ERASING, FLASH_WRITING, FLASH_CLEARING};
+uint8_t FlashState = FLASH_IDLE;
+uint32_t FlashAddress;
+uint16_t FlashTick;		//start of the current SPM operation
+uint8_t RwwEnabled = 1;	//the RWW section can be read, cleared by every erase and write
+
+//Flash read back
+//a run of the RWW section is read with ELPM Z+, which increments the whole RAMPZ:Z address, so RAMPZ is only
+//loaded once per run and the loop is 9 cycles a byte, instead of building a far address for every
+//pgm_read_byte_far. A host build (see HostSim) replaces the run with a read of its flash model
+#ifndef BOOT_FLASH_READ_RUN
+#define BOOT_FLASH_READ_RUN(address,buf,length) boot_flash_read_run(address,buf,length)
+static void boot_flash_read_run (uint32_t address, uint8_t *buf, uint16_t length)
 {
-	uint8_t sreg = SREG;	//Save current interrupts
-	
-	cli();					//Disable interrupts
+	//length (not 0) bytes from address into buf, the run must not cross a 64KB boundary
+	uint16_t z = address & 0xFFFF;
+	RAMPZ = address >> 16;
+	asm volatile (
+		"1:	elpm __tmp_reg__, Z+	\n\t"
+		"	st X+, __tmp_reg__		\n\t"
+		"	sbiw %[count], 1		\n\t"
+		"	brne 1b					\n\t"
+		: "+z" (z), "+x" (buf), [count] "+w" (length)
+		:
+		: "memory");
+}
+#endif
+
+#define FLASH_CHUNK 32		//bytes read at a time when the flash is checked or summed instead of copied
+
+static void boot_rww_ready (void)
+{
+	//the RWW section can't be read after an erase or write until it is enabled again, the flash must be idle
+	if(!RwwEnabled)
+	{
+		boot_rww_enable ();		//Enable reading of main flash
+		while(boot_rww_busy());	//Wait till main flash section is ready for reading
+		RwwEnabled = 1;
+	}
+}
+
+void boot_flash_read (uint32_t address, uint8_t *buf, uint16_t length)
+{
+	//read a range of the RWW section, in runs split where RAMPZ changes
+	boot_rww_ready();
+	while(length > 0)
+	{
+		uint32_t boundary = (address | 0xFFFFUL) + 1;
+		uint16_t run = (boundary - address < length) ? boundary - address : length;
+		BOOT_FLASH_READ_RUN(address,buf,run);
+		address += run;
+		buf += run;
+		length -= run;
+	}
+}
+
+uint32_t boot_flash_crc (uint32_t address, uint16_t length, uint32_t crc)
+{
+	//fold a range of flash into a running CRC32, a chunk at a time through a small buffer on the stack
+	uint8_t chunk[FLASH_CHUNK];
+	while(length > 0)
+	{
+		uint16_t run = length < FLASH_CHUNK ? length : FLASH_CHUNK;
+		boot_flash_read(address,chunk,run);
+		crc = crc32_update_block(crc,chunk,run);
+		address += run;
+		length -= run;
+	}
+	return crc;
+}
+
+#if BOOT_DUMP
+//next flash address of a DUMP, read a chunk at a time by boot_flash_source while the W5100 frames shift out
+static uint32_t DumpAddress;
+static uint8_t DumpChunk[FLASH_CHUNK];
+static uint8_t DumpPosition;	//next byte of DumpChunk to send, DumpLength when it has all been sent
+static uint8_t DumpLength;
+#define DUMP_MIN_SEND 256	//smallest write to the transmit buffer short of the end of the range
+#define DUMP_MAX_SEND 4096	//largest, half the 8KB transmit buffer, one half is filled while the other is on its way
+
+static unsigned char boot_flash_source (void)
+{
+	//refilled with ELPM runs (boot_flash_read), never reading past the end of the flash
+	if(DumpPosition == DumpLength)
+	{
+		DumpLength = FLASHEND + 1UL - DumpAddress < FLASH_CHUNK ? FLASHEND + 1UL - DumpAddress : FLASH_CHUNK;
+		boot_flash_read(DumpAddress,DumpChunk,DumpLength);
+		DumpAddress += DumpLength;
+		DumpPosition = 0;
+	}
+	return DumpChunk[DumpPosition++];
+}
+#endif
+
+void boot_page_commit (uint32_t page)
+{
+	//program the page from the SPM page buffer, which must be full, finishes through boot_page_ready()
+	FlashAddress = page*SPM_PAGESIZE; //get the first address of the selected page
 	
-	uint32_t Page_Add = page*SPM_PAGESIZE; //get the first address of the selected page
+	uint8_t sreg = SREG;
+	cli();
+	boot_page_erase (FlashAddress); //erase in the background, the page buffer is kept
+	SREG = sreg;
+	RwwEnabled = 0;
+	FlashState = FLASH_ERASING;
+	FlashTick = stat_ticks();
+	Stats.pages_programmed++;
+}
+
+void boot_page_start (uint32_t page, uint8_t *buf)
+{
+	//boot_page_ready() must have returned 1 before a new page is started
 	
-	eeprom_busy_wait ();
-	boot_page_erase (Page_Add);
-	boot_spm_busy_wait ();	//Wait until the memory is erased
+	uint8_t sreg = SREG;	//Save current interrupts
+	cli();					//Disable interrupts, the SPM sequences are timed
 	
+	eeprom_busy_wait ();	//an EEPROM write during the page buffer fill would corrupt the buffer
 	for (uint16_t i=0; i<SPM_PAGESIZE; i+=2)
 	{
 		//Set up little-endian word, and write one word at a time
 		uint16_t w = *buf++;
 		w += (*buf++) << 8;
-		boot_page_fill (Page_Add + i, w);
+		boot_page_fill (i, w);	//only the offset in the page is used
 	}
-	boot_page_write (Page_Add); //Store buffer in flash page
-	boot_spm_busy_wait();	//Wait until the memory is written
 	
 	SREG = sreg;			//Restore interrupts (if any were set)
+	boot_page_commit(page);
+}
+
+//Page receive, while the flash is idle a page of the image is taken from the socket straight into the SPM page
+//buffer as it arrives, through boot_page_fill, instead of being staged in SRAM and copied. Nothing else may use the
+//flash or the EEPROM until the page is complete: RWW reading is enabled before the first byte (RWWSRE clears the
+//page buffer) and an EEPROM write would lose the data loaded. While a page is being programmed the next one still
+//goes to SRAM, so the receive overlaps the erase and write
+uint16_t PageFill;		//bytes of the page in the SPM page buffer
+uint8_t PageFillLow;	//the low byte of the word being filled
+
+static void boot_page_fill_byte (unsigned char data)
+{
+	//sink for wiznet_receive_tcp_sink, pairs the bytes into little-endian words
+	if(PageFill & 1)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		boot_page_fill (PageFill - 1, PageFillLow | (data << 8));
+		SREG = sreg;
+	}
+	else
+	{
+		PageFillLow = data;
+	}
+	PageFill++;
+}
+
+uint8_t boot_page_receive (uint8_t *buf, uint16_t *fill, uint16_t available, uint8_t direct)
+{
+	//take up to available bytes of a page, into the SPM page buffer if direct is set when the page starts
+	//or else into buf (*fill bytes so far), returns 1 once the page is complete, PageFill is then SPM_PAGESIZE
+	//if it is in the page buffer (start it with boot_page_commit and clear PageFill)
+	if(available == 0)
+	{
+		return 0;
+	}
+	if(PageFill > 0 || (*fill == 0 && direct))
+	{
+		uint16_t length = SPM_PAGESIZE - PageFill;
+		length = length < available ? length : available;
+		if(PageFill == 0)
+		{
+			boot_rww_ready();
+			eeprom_busy_wait();
+		}
+		wiznet_receive_tcp_sink(boot_page_fill_byte,length,Sock_Offset);
+		return PageFill == SPM_PAGESIZE;
+	}
+	
+	uint16_t length = SPM_PAGESIZE - *fill;
+	length = length < available ? length : available;
+	wiznet_receive_tcp(buf + *fill,length,Sock_Offset);
+	*fill += length;
+	if(*fill == SPM_PAGESIZE)
+	{
+		*fill = 0;
+		return 1;
+	}
+	return 0;
+}
+
+void boot_page_abandon (void)
+{
+	//drop a page left part way through the SPM page buffer, each word can only be filled once until it is cleared
+	//the flash must be idle
+	if(PageFill > 0)
+	{
+		boot_rww_enable ();		//clears the page buffer
+		RwwEnabled = 1;
+		PageFill = 0;
+	}
+}
+
+uint8_t boot_page_ready (void)
+{
+	//call from the main loop, moves a started page from erase to write when the SPM operation finishes
+	//returns 1 when no page is being programmed
+	
+	if(FlashState != FLASH_IDLE && !boot_spm_busy())
+	{
+		uint16_t now = stat_ticks();
+		if(FlashState == FLASH_ERASING)
+		{
+			uint8_t sreg = SREG;
+			cli();
+			boot_page_write (FlashAddress); //Store buffer in flash page
+			SREG = sreg;
+			FlashState = FLASH_WRITING;
+			Stats.erase_ticks += (uint16_t)(now - FlashTick);
+		}
+		else
+		{
+			if(FlashState == FLASH_WRITING)
+			{
+				Stats.write_ticks += (uint16_t)(now - FlashTick);
+			}
+			else
+			{
+				Stats.erase_ticks += (uint16_t)(now - FlashTick);
+			}
+			FlashState = FLASH_IDLE;
+		}
+		FlashTick = now;
+	}
+	return FlashState == FLASH_IDLE;
+}
+
+void boot_page_clear (uint32_t page)
+{
+	//erase a page without writing it, finishes through boot_page_ready() like boot_page_start
+	FlashAddress = page*SPM_PAGESIZE;
+	
+	uint8_t sreg = SREG;
+	cli();
+	eeprom_busy_wait ();
+	boot_page_erase (FlashAddress);
+	SREG = sreg;
+	RwwEnabled = 0;
+	FlashState = FLASH_CLEARING;	//idle once the erase finishes
+	FlashTick = stat_ticks();
+	Stats.pages_erased++;
+}
+
+uint8_t boot_page_erased (uint32_t page)
+{
+	//returns 1 when every byte of the page is already 0xFF, reading is far quicker than an erase
+	uint16_t start = stat_ticks();
+	uint32_t Page_Add = page*SPM_PAGESIZE;
+	uint8_t chunk[FLASH_CHUNK];
+	uint8_t erased = 0xFF;
+	
+	for (uint16_t i = 0; i < SPM_PAGESIZE && erased == 0xFF; i += FLASH_CHUNK)
+	{
+		boot_flash_read(Page_Add+i,chunk,FLASH_CHUNK);
+		for (uint8_t j = 0; j < FLASH_CHUNK; j++)
+		{
+			erased &= chunk[j];
+		}
+	}
+	erased = erased == 0xFF;
+	Stats.readback_ticks += (uint16_t)(stat_ticks() - start);
+	return erased;
+}
+
+void boot_program_page (uint32_t page, uint8_t *buf)
+{
+	//program a page and wait for it to finish
+	while(!boot_page_ready())
+	{
+		boot_spm_busy_wait();
+	}
+	boot_page_start(page,buf);
+	while(!boot_page_ready())
+	{
+		boot_spm_busy_wait();
+	}
 }
 
 void boot_read_page (uint32_t page, uint8_t *buf)
 {
-	boot_rww_enable ();		//Enable reading of main flash
-	while(boot_rww_busy());	//Wait till main flash section is ready for reading
-	uint32_t Page_Add = page*SPM_PAGESIZE; //get the first address of the selected page
+	uint16_t start = stat_ticks();
+	boot_flash_read(page*SPM_PAGESIZE,buf,SPM_PAGESIZE);
+	Stats.readback_ticks += (uint16_t)(stat_ticks() - start);
+}
+
+uint8_t boot_page_equal (uint32_t page, const uint8_t *buf)
+{
+	//returns 1 when the page already holds buf, reading is far quicker than programming
+	uint16_t start = stat_ticks();
+	uint32_t Page_Add = page*SPM_PAGESIZE;
+	uint8_t chunk[FLASH_CHUNK];
+	uint8_t equal = 1;
 	
-	//read the page one byte at a time into the buffer
-	for (uint16_t i = 0; i < SPM_PAGESIZE; i++ )
+	for (uint16_t i = 0; i < SPM_PAGESIZE && equal; i += FLASH_CHUNK)
 	{
-		buf[i] = pgm_read_byte_far((Page_Add)+i);
+		boot_flash_read(Page_Add+i,chunk,FLASH_CHUNK);
+		for (uint8_t j = 0; j < FLASH_CHUNK; j++)
+		{
+			equal &= chunk[j] == buf[i+j];
+		}
+	}
+	Stats.readback_ticks += (uint16_t)(stat_ticks() - start);
+	return equal;
+}
+
+//Staged updates, the application programs the staging area and the manifest through these while it keeps running
+//(see BootApi.h), the boot loader installs the image at the next reset. The rest of the table hands the application
+//the boot loader's W5100 block transfers, page programming and network settings
+#define BOOT_API_STR(x) #x
+#define BOOT_API_WORD(x) ".word " BOOT_API_STR(x) "	\n\t"
+#ifndef BOOT_API_TABLE
+#define BOOT_API_TABLE boot_api_table
+void boot_api_table (void) __attribute__((naked, used, section(".bootapi")));
+void boot_api_table (void)
+{
+	//the fixed entry points, in the order of the BOOT_API_ addresses, then the version word
+	asm volatile (
+		"jmp boot_api_stage_page	\n\t"
+		"jmp boot_api_stage_commit	\n\t"
+		"jmp wiznet_read_block_stateless	\n\t"
+		"jmp wiznet_write_block_stateless	\n\t"
+		"jmp boot_api_program_page	\n\t"
+		"jmp boot_api_read_page	\n\t"
+		"jmp boot_api_network_config	\n\t"
+		BOOT_API_WORD(BOOT_API_VERSION)
+		::);
+}
+#endif
+
+static uint8_t boot_api_program (uint32_t address, const uint8_t *buf)
+{
+	//erase and write one page and wait for both, with interrupts off throughout
+	uint8_t sreg = SREG;
+	cli();
+	eeprom_busy_wait ();
+	boot_spm_busy_wait ();
+	for (uint16_t i=0; i<SPM_PAGESIZE; i+=2)
+	{
+		uint16_t w = *buf++;
+		w += (*buf++) << 8;
+		boot_page_fill (address + i, w);
+	}
+	boot_page_erase (address);
+	boot_spm_busy_wait ();
+	boot_page_write (address);
+	boot_spm_busy_wait ();
+	boot_rww_enable ();		//the application runs from the RWW section, it must be readable again before returning
+	while(boot_rww_busy());
+	SREG = sreg;
+	return 1;
+}
+
+uint8_t boot_api_stage_page (uint16_t index, const uint8_t *buf)
+{
+	if(!BOOT_STAGE || index >= BOOT_STAGE_PAGES)
+	{
+		return 0;
+	}
+	return boot_api_program((uint32_t)(BOOT_STAGE_START_PAGE + index) * SPM_PAGESIZE,buf);
+}
+
+uint8_t boot_api_program_page (uint16_t page, const uint8_t *buf)
+{
+	//any page of the application section, the boot loader can't be overwritten
+	if(page >= APP_PAGES)
+	{
+		return 0;
+	}
+	return boot_api_program((uint32_t)page * SPM_PAGESIZE,buf);
+}
+
+uint8_t boot_api_read_page (uint16_t page, uint8_t *buf)
+{
+	//the flash is never busy here, every program call waits for its write
+	if(page >= (FLASHEND + 1UL) / SPM_PAGESIZE)
+	{
+		return 0;
+	}
+	BOOT_FLASH_READ_RUN((uint32_t)page * SPM_PAGESIZE,buf,SPM_PAGESIZE);
+	return 1;
+}
+
+void boot_api_network_config (uint8_t *config, uint8_t write)
+{
+	//the 18 bytes in the order IPST sends them
+	if(write)
+	{
+		write_IP_EEPROM(config,config + 4,config + 8,config + 14);
+	}
+	else
+	{
+		read_IP_EEPROM(config,config + 4,config + 8,config + 14);
+	}
+}
+
+uint8_t boot_api_stage_commit (uint16_t pages, uint32_t crc)
+{
+	//record the staged image, the magic goes last so a reset part way through leaves no image rather than a wrong one
+	if(!BOOT_STAGE || pages > BOOT_STAGE_PAGES)
+	{
+		return 0;
+	}
+	eeprom_update_byte(&Eeprom.Stage.magic,0x00);
+	if(pages > 0)
+	{
+		eeprom_update_block(&pages,&Eeprom.Stage.pages,sizeof(pages));
+		eeprom_update_block(&crc,&Eeprom.Stage.crc,sizeof(crc));
+		eeprom_update_byte(&Eeprom.Stage.magic,STAGE_MAGIC);
+	}
+	return 1;
+}
+
+//Start the TCP listener the boot loader normally waits on
+void network_listen_tcp(void)
+{
+	wiznet_init(WIZNET_MEM_SOCKET0,WIZNET_MEM_SOCKET0);	//only socket 0 is used, give it all 8KB of RX and TX memory
+	wiznet_set_config(gateway_ip,subnet_mask,mac_address,device_ip_address);
+	wiznet_socket_listen(Sock_Offset,Listen_Port);	//Setup a TCP listener port
+	wiznet_interrupt_enable(0x01);
+	WiznetEvent = 1;
+}
+
+//Start the application, reason is one of BOOT_EXIT_ (BootHandoff.h). Unless it is a fast boot or a staged install
+//(which happen before anything has been set up) the hardware the boot loader used is reset first, or with
+//WarmHandoff set the W5100 is left configured for the application instead: its sockets are closed and its
+//interrupts masked, but the network settings, the socket memory layout, the SPI registers and the chip select
+//pins of the W5100 and the SD card stay as they are.
+//The handoff block is written last, it is where the stack started, so nothing on it is used after that
+void boot_exit (uint8_t reason) __attribute__((noinline));
+void boot_exit (uint8_t reason)
+{
+	BootHandoff handoff;
+	handoff.magic = BOOT_HANDOFF_MAGIC;
+	handoff.version = BOOT_HANDOFF_VERSION;
+	handoff.length = sizeof(BootHandoff);
+	handoff.reason = reason;
+	handoff.flags = 0;
+	read_IP_EEPROM(handoff.gateway_ip,handoff.subnet_mask,handoff.mac_address,handoff.device_ip_address);
+	handoff.rx_layout = 0;
+	handoff.tx_layout = 0;
+	for(uint8_t i = 0; i < 4; i++)
+	{
+		handoff.socket_status[i] = 0;
+	}
+	
+	if(reason >= BOOT_EXIT_TIMEOUT)
+	{
+		//Disable all interrupts
+		cli();
+		EIMSK &= ~(1<<INT4);
+		
+		uint8_t warm = eeprom_read_byte(&Eeprom.WarmHandoff);
+		if(warm)
+		{
+			//the settings from EEPROM, the chip still has the old ones after an IPST
+			wiznet_set_config(handoff.gateway_ip,handoff.subnet_mask,handoff.mac_address,handoff.device_ip_address);
+			wiznet_interrupt_enable(0x00);
+			wiznet_socket_close(Sock_Offset);
+			wiznet_read_block(0x001A,&handoff.rx_layout,2);		//RMSR and TMSR
+			for(uint8_t i = 0; i < 4; i++)
+			{
+				wiznet_read_block(0x0403 + (i << 8),&handoff.socket_status[i],1);	//Sn_SR
+			}
+			handoff.flags = BOOT_HANDOFF_W5100_READY;
+			
+			//keep SPI (PB0-PB3), the W5100 chip select (PB4) and the SD card chip select (PG5)
+			PORTB &= 0x1F;
+			DDRB &= 0x1F;
+			PORTG &= (1<<PG5);
+			DDRG &= (1<<PG5);
+		}
+		else
+		{
+			//reset the ports
+			PORTB = 0x00;
+			DDRB = 0x00;
+			PORTG = 0x00;
+			DDRG = 0x00;
+			
+			//Reset SPI registers
+			SPCR = 0x00;
+			SPSR = 0x00;
+		}
+		
+		//the W5100 INT input, its pull-up and the sleep mode
+		PORTE &= ~(1<<PE4);
+		EICRB = 0x00;
+		SMCR = 0x00;
+		
+		//reset Timer settings
+		TCCR1A = 0x00;
+		TCCR1B = 0x00;
+		TCCR1C = 0x00;
+		OCR1A = 0x00;
+		TIMSK1 = 0x00;
+		TCCR3B = 0x00;		//and the performance counter timer
+		TCCR3A = 0x00;
+		TCNT3 = 0x0000;
+		OCR3A = 0x0000;
+		TIMSK3 = 0x00;
+		
+		//Put interrupt vectors back in main flash land
+		//these two writes must occur within 4 cycles
+		MCUCR = (1<<IVCE);
+		MCUCR = 0;
+		
+		// enable the main flash for use by the main application
+		boot_rww_enable ();
+	}
+	
+	handoff.check = boot_handoff_check(&handoff);
+	volatile uint8_t *block = (volatile uint8_t *)BOOT_HANDOFF_BLOCK;
+	for(uint8_t i = 0; i < sizeof(BootHandoff); i++)
+	{
+		block[i] = ((uint8_t *)&handoff)[i];
+	}
+	BOOT_JUMP_APPLICATION();
+}
+
+uint32_t boot_page_crc (uint32_t page, uint32_t crc)
+{
+	//fold one page of flash into a running CRC32
+	uint16_t start = stat_ticks();
+	crc = boot_flash_crc(page*SPM_PAGESIZE,SPM_PAGESIZE,crc);
+	Stats.readback_ticks += (uint16_t)(stat_ticks() - start);
+	return crc;
+}
+
+uint8_t stat_record (uint8_t *buf)
+{
+	//the STAT reply: record version, record length, tick length in us (2 bytes),
+	//then the counters as 32bit values, all little endian (see BootProtocol.h in HostTools)
+	const uint32_t counters[] = {wiznet_counters.spi_frames, wiznet_counters.rx_bytes, wiznet_counters.tx_bytes,
+								 Stats.pages_programmed, Stats.pages_erased, Stats.run_ticks,
+								 Stats.rx_wait_ticks, Stats.tx_wait_ticks, Stats.flash_wait_ticks,
+								 Stats.erase_ticks, Stats.write_ticks, Stats.readback_ticks};
+	uint8_t length = 0;
+	buf[length++] = STAT_RECORD_VERSION;
+	buf[length++] = STAT_RECORD_LENGTH;
+	buf[length++] = STAT_TICK_US;
+	buf[length++] = 0;
+	for(uint8_t i = 0; i < sizeof(counters)/sizeof(counters[0]); i++)
+	{
+		buf[length++] = counters[i] & 0xFF;
+		buf[length++] = (counters[i] >> 8) & 0xFF;
+		buf[length++] = (counters[i] >> 16) & 0xFF;
+		buf[length++] = (counters[i] >> 24) & 0xFF;
+	}
+	return length;
+}
+
+uint32_t boot_page_digest (uint32_t page)
+{
+	//CRC32 of one page of flash
+	return crc32_final(boot_page_crc(page,CRC32_INIT));
+}
+
+#if BOOT_STAGE
+uint32_t boot_image_crc (uint32_t first_page, uint16_t pages)
+{
+	//CRC32 of a run of pages
+	uint32_t crc = CRC32_INIT;
+	for(uint16_t page = 0; page < pages; page++)
+	{
+		crc = boot_page_crc(first_page + page,crc);
+	}
+	return crc32_final(crc);
+}
+
+uint8_t boot_stage_install (void)
+{
+	//copy a staged image over the application if its CRC checks out, returns 1 if it was installed
+	//the manifest is only cleared once the copy is done, so a reset part way through starts it again,
+	//pages that already match are skipped, which also makes the restart quick
+	StageManifest manifest;
+	eeprom_read_block(&manifest,&Eeprom.Stage,sizeof(manifest));
+	if(manifest.magic != STAGE_MAGIC)
+	{
+		return 0;
+	}
+	
+	uint8_t installed = 0;
+	if(manifest.pages > 0 && manifest.pages <= BOOT_STAGE_PAGES
+	   && boot_image_crc(BOOT_STAGE_START_PAGE,manifest.pages) == manifest.crc)
+	{
+		uint8_t page_buf[SPM_PAGESIZE];
+		eeprom_update_byte(&Eeprom.Programmed,0x00);	//a half copied application must not be started
+		for(uint16_t page = 0; page < manifest.pages; page++)
+		{
+			boot_read_page(BOOT_STAGE_START_PAGE + page,page_buf);
+			if(!boot_page_equal(page,page_buf))
+			{
+				boot_program_page(page,page_buf);
+			}
+		}
+		installed = boot_image_crc(0,manifest.pages) == manifest.crc;
+		if(installed)
+		{
+			eeprom_write_byte(&Eeprom.Programmed,0x01);
+		}
+	}
+	eeprom_write_byte(&Eeprom.Stage.magic,0x00);	//a staged image that failed its CRC is dropped, the application stays as it was
+	return installed;
+}
+#else
+#define boot_stage_install() 0		//the API refuses to stage anything, so there is never an image to install
+#endif
+
+//Update session, the state of the main loop and what its states share. It lives in main's stack frame and each
+//state has a handler below that is given a pointer to it, they are only called from main, so they are inlined
+//and the session stays in registers and the stack frame as it would as main's own variables
+enum {WAIT_START, HEADER, DIGEST, PROGRAMMING, VERIFY, OK, END, IPSET, STAT, DUMP_RANGE, DUMP};
+typedef struct
+{
+	uint8_t status;
+	uint8_t DigestNext;			//state to go to once DIGEST has sent every page digest
+	uint8_t StatNext;			//state to go back to once STAT has sent the counters
+	uint8_t StatTail;			//"AT" of a STAT sent in place of OK is still to be read
+	uint8_t ExitReason;			//handed to the application when END starts it (BootHandoff.h)
+	
+	uint8_t BufferFull;			//Buffer holds a received page that has not been started yet
+	uint32_t BufferPage;		//flash page the received page belongs to
+	uint16_t BufferFill;		//received bytes of the page (see boot_page_receive)
+	
+	uint32_t PageIndex;			//current active page
+	uint32_t Pages;				//total pages to verify/write
+	uint32_t Transfers;			//pages to receive in PROGRAMMING
+	
+	//Delta mode (DLTA command), the boot loader sends a digest of every page and the host only sends
+	//the pages that differ, as records of a 2 byte page index followed by the page. Read with DELTA_MODE, which is
+	//constant 0 without BOOT_DELTA, so the compiler drops the code behind it
+	uint8_t DeltaMode;
+	uint8_t RecordIndexValid;	//the page index of the next record has been received
+	
+	//CRC verify (HEADER_VERIFY_CRC), VERIFY sends one CRC32 of the whole image read back from flash
+	//instead of echoing every page, pages written in order are folded in as soon as they finish
+	uint8_t CrcVerify;
+	uint32_t ImageCrc;
+	uint32_t CrcPage;			//next page to fold into ImageCrc
+	uint32_t PagesStarted;		//pages started in order, all written once boot_page_ready() returns 1
+	
+	//Sparse images (HEADER_SEGMENTS), each segment is a start page and page count (2 bytes each, little endian)
+	//followed by its pages, in ascending order. The pages between segments are erased instead of being sent,
+	//so Pages only becomes the image size once the last segment is in. Read with SEGMENT_MODE, which is constant 0
+	//without BOOT_SEGMENTS, so the compiler drops the code behind it
+	uint8_t SegmentMode;
+	uint32_t SegmentsLeft;		//descriptors still to be received
+	uint32_t SegmentStart;		//flash page of the next page of the current segment
+	uint16_t SegmentPages;		//pages of the current segment still to be received
+	uint32_t NextPage;			//every page below this is programmed, erased or being received
+	
+#if BOOT_DUMP
+	//Flash dump (DUMP command), followed by the start address and length of a range of the flash (4 bytes each,
+	//little endian), the device sends the range and then takes the next command. Every pass writes as much of it
+	//as the transmit buffer has room for straight from the flash, and the commit at the end of the pass sends it
+	//with one SEND, so the host's ACKs pace it instead of a page at a time
+	uint32_t DumpRemaining;
+#endif
+	
+	//socket 0 buffer sizes, kept by the driver, which only reads them from the chip once the interrupt flags
+	//say they have changed. The flags are read after an interrupt, or after data has been moved in case INT is not connected
+	unsigned short RX_Data;
+	unsigned short TX_Size;
+	uint8_t FlagsStale;
+	uint8_t Disconnected;		//DISCON or TIMEOUT, acted on once the received data has been read
+} BootSession;
+
+#define DELTA_MODE(session) (BOOT_DELTA && (session)->DeltaMode)
+#define SEGMENT_MODE(session) (BOOT_SEGMENTS && (session)->SegmentMode)
+
+//buffer for ethernet communication
+//same size as a page, allowing reading/writing one page at a time
+static uint8_t Buffer[SPM_PAGESIZE];
+
+//Socket 0 events, the interrupt flags when they may have changed, the buffer sizes, and the end of a connection
+static void boot_socket_events (BootSession *session)
+{
+	if(WiznetEvent || session->FlagsStale)
+	{
+		WiznetEvent = 0;
+		session->FlagsStale = 0;
+		uint8_t IntLine = PINE & (1<<PE4);		//before the flags are cleared, low if INT is connected
+		uint8_t Flags = wiznet_socket_interrupts(Sock_Offset);
+		if(Flags && IntLine && !(TIMSK3 & (1<<OCIE3A)))
+		{
+			//INT is not connected (or went low just after PINE was read, which only costs the poll tick)
+			OCR3A = TCNT3 + WIZNET_POLL_TICKS;
+			TIMSK3 = (1<<OCIE3A);
+		}
+		if(Flags & (WIZNET_IR_DISCON | WIZNET_IR_TIMEOUT))
+		{
+			session->Disconnected = 1;
+		}
+		EIMSK |= (1<<INT4);
+	}
+	session->RX_Data = wiznet_Rx_size(Sock_Offset);	//Get the amount of data in the receive buffer
+	session->TX_Size = wiznet_Tx_size(Sock_Offset);	//Get the free space in the transmit buffer
+	
+	if(session->Disconnected && session->RX_Data > 0)
+	{
+		//the bytes the state waits for before it reads anything, what the closed connection left short of that
+		//(part of a command, a header or a page) will never be completed, so it is read and dropped
+		uint16_t Wanted = session->status == WAIT_START ? 4 :
+						  session->status == HEADER ? 4 :
+						  session->status == IPSET ? 18 :
+						  session->status == DUMP_RANGE ? 8 :
+						  session->status == OK || (session->status == STAT && session->StatTail) ? 2 :
+						  session->status == PROGRAMMING ? SPM_PAGESIZE :
+						  0xFFFF;	//a state that reads nothing more from this connection
+		while(session->RX_Data > 0 && session->RX_Data < Wanted)
+		{
+			uint16_t chunk = session->RX_Data < SPM_PAGESIZE ? session->RX_Data : SPM_PAGESIZE;
+			wiznet_receive_tcp(Buffer,chunk,Sock_Offset);
+			session->RX_Data -= chunk;
+		}
+	}
+	
+	if(session->Disconnected && session->RX_Data == 0)
+	{
+		//the connection has closed and everything it sent has been read or dropped
+		session->Disconnected = 0;
+		if(session->status == WAIT_START)
+		{
+			wiznet_socket_listen(Sock_Offset,Listen_Port);	//ready for the next connection
+		}
+		else
+		{
+			//lost in the middle of a session, give up on it straight away instead of waiting for the timeout
+			//and listen again once END has gone back to WAIT_START
+			session->status = END;
+			session->Disconnected = 1;
+		}
+	}
+}
+
+//WAIT_START, the command that starts a session
+static void boot_wait_start (BootSession *session)
+{
+	if(session->RX_Data >= 4)
+	{
+		//Must receive a PROG command to start the process of writing a new application
+		wiznet_receive_tcp(Buffer,4,Sock_Offset);
+		if(Buffer[0] == 'P' && Buffer[1] == 'R' && Buffer[2] == 'O' && Buffer[3] == 'G')
+		{
+			unsigned char Version_Reply[] = "V1.0\r\n";			//send the version of the logger/bootloader
+			wiznet_send_tcp(Version_Reply,6,Sock_Offset);		//5 bytes to include the null termination
+			Sec_Timeout = 10;									//reset the timeout to 10 seconds
+			session->DeltaMode = 0;
+			session->status = HEADER;
+		}
+#if BOOT_DELTA
+		else if(Buffer[0] == 'D' && Buffer[1] == 'L' && Buffer[2] == 'T' && Buffer[3] == 'A')
+		{
+			//same as PROG, but only the pages that differ from the current flash are sent
+			unsigned char Version_Reply[] = "V1.0\r\n";
+			wiznet_send_tcp(Version_Reply,6,Sock_Offset);
+			Sec_Timeout = 10;
+			session->DeltaMode = 1;
+			session->status = HEADER;
+		}
+#endif
+		else if(Buffer[0] == 'S' && Buffer[1] == 'T' && Buffer[2] == 'A' && Buffer[3] == 'T')
+		{
+			//performance counters since the boot loader started
+			unsigned char Version_Reply[] = "V1.0\r\n";
+			wiznet_send_tcp(Version_Reply,6,Sock_Offset);
+			Sec_Timeout = 10;
+			session->StatTail = 0;
+			session->StatNext = WAIT_START;
+			session->status = STAT;
+		}
+#if BOOT_DUMP
+		else if(Buffer[0] == 'D' && Buffer[1] == 'U' && Buffer[2] == 'M' && Buffer[3] == 'P')
+		{
+			//followed by the range of flash to send
+			unsigned char Version_Reply[] = "V1.0\r\n";
+			wiznet_send_tcp(Version_Reply,6,Sock_Offset);
+			Sec_Timeout = 10;
+			session->status = DUMP_RANGE;
+		}
+#endif
+		else if(Buffer[0] == 'I' && Buffer[1] == 'P' && Buffer[2] == 'S' && Buffer[3] == 'T')
+		{
+			unsigned char Version_Reply[] = "V1.0\r\n";			//send the version of the logger/bootloader
+			wiznet_send_tcp(Version_Reply,6,Sock_Offset);		//5 bytes to include the null termination
+			Sec_Timeout = 10;									//reset the timeout to 10 seconds
+			session->status = IPSET;
+		}
+	}
+}
+
+//IPSET, update the TCP/IP settings
+static void boot_ipset (BootSession *session)
+{
+	if(session->RX_Data >= 18) //wait for full TCP/IP settings packet
+	{
+		wiznet_receive_tcp(Buffer,18,Sock_Offset);
+					
+		//Packet Structure - 18 bytes
+		//----------------------
+		//Packet[0-3] - GateIP 4 bytes
+		//Packet[4-7] - SubMask 4 bytes
+		//Packet[8-13] - MacAdd 6 bytes
+		//Packet[14-17] - DeviceIP 4 bytes
+		//----------------------
+					
+		//copy packet data into correct arrays
+		for (int i = 0; i< 6; i++)
+		{
+			if(i < 4)
+			{
+				gateway_ip[i] = Buffer[i];
+				subnet_mask[i] = Buffer[i+4];
+				device_ip_address[i] = Buffer[i+14];
+			}
+			mac_address[i] = Buffer[i+8];
+		}
+					
+		write_IP_EEPROM(gateway_ip,subnet_mask,mac_address,device_ip_address);
+		session->ExitReason = BOOT_EXIT_IPSET;
+					
+		Sec_Timeout = 0; //set timeout to zero to restart the MCU and load new IP settings
+		session->status = WAIT_START;
+	}
+}
+
+//HEADER, the page count and option flags of the image
+static void boot_header (BootSession *session)
+{
+	if(session->RX_Data >= 4)
+	{
+		//the header is a 32bit value (4 bytes) that indicates the amount of pages to be written,
+		//the top byte holds option flags (HEADER_VERIFY_CRC), older hosts always send 0 there
+		wiznet_receive_tcp(Buffer,4,Sock_Offset);
+		session->Pages = (uint32_t)Buffer[0] + ((uint32_t)Buffer[1]<<8) + ((uint32_t)Buffer[2]<<16);
+		session->CrcVerify = (Buffer[3] & HEADER_VERIFY_CRC) != 0;
+#if BOOT_SEGMENTS
+		session->SegmentMode = (Buffer[3] & HEADER_SEGMENTS) && !DELTA_MODE(session);
+#else
+		if((Buffer[3] & HEADER_SEGMENTS) && !DELTA_MODE(session))
+		{
+			//a sparse image, which this build can't take, give up before the application is touched
+			session->status = END;
+			return;
+		}
+#endif
+		if(!SEGMENT_MODE(session) && session->Pages > APP_PAGES)
+		{
+			//more pages than the application section holds, they would run into the boot loader,
+			//give up before the application is touched (segments are checked one at a time)
+			session->status = END;
+			return;
+		}
+		
+		//clear the programmed status, as the program can no longer be guaranteed to be OK
+		eeprom_write_byte(&Eeprom.Programmed,0x00); 
+		eeprom_update_byte(&Eeprom.Stage.magic,0x00);	//and an image staged earlier must not replace this one
+		Sec_Timeout = 10; //reset the timeout
+		session->PageIndex = 0;
+		session->BufferFull = 0;
+		session->RecordIndexValid = 0;
+		session->BufferFill = 0;
+		session->ImageCrc = CRC32_INIT;
+		session->CrcPage = 0;
+		session->PagesStarted = 0;
+		session->NextPage = 0;
+		session->SegmentPages = 0;
+		
+		if(SEGMENT_MODE(session))
+		{
+			//only the segment pages are echoed by the host, so the image is always checked by its CRC,
+			//the number of pages is not known until the last segment
+			session->SegmentsLeft = session->Pages;
+			session->Pages = 0;
+			session->CrcVerify = 1;
+			session->Transfers = 0xFFFFFFFF;
+			session->status = PROGRAMMING;
+		}
+		else if(DELTA_MODE(session))
+		{
+			//send the digests of the current flash first, the number of records is not known
+			//until the host ends them with a page index of 0xFFFF
+			session->Transfers = 0xFFFF;
+			session->DigestNext = PROGRAMMING;
+			session->status = DIGEST;
+		}
+		else
+		{
+			session->Transfers = session->Pages;
+			session->status = PROGRAMMING;
+		}
+	}
+}
+
+//DIGEST, the page digests of a delta upload
+static void boot_digest (BootSession *session)
+{
+	//send a CRC32 (4 bytes, little endian) of every page of the image,
+	//64 pages at a time so each send fills one buffer of digests
+	if(session->PageIndex < session->Pages && session->TX_Size >= SPM_PAGESIZE && boot_page_ready())
+	{
+		uint16_t length = 0;
+		while(length < SPM_PAGESIZE && session->PageIndex < session->Pages)
+		{
+			uint32_t digest = boot_page_digest(session->PageIndex++);
+			Buffer[length++] = digest & 0xFF;
+			Buffer[length++] = (digest >> 8) & 0xFF;
+			Buffer[length++] = (digest >> 16) & 0xFF;
+			Buffer[length++] = (digest >> 24) & 0xFF;
+		}
+		if(wiznet_send_tcp(Buffer,length,Sock_Offset) == 0)
+		{
+			//connection must have been lost
+			session->status = END;
+			return;
+		}
+	}
+	
+	if(session->PageIndex == session->Pages)
+	{
+		session->PageIndex = 0;
+		Sec_Timeout = 10;	//reset timer
+		session->status = session->DigestNext;
+	}
+}
+
+#if BOOT_DUMP
+//DUMP_RANGE, the range of flash a DUMP is to send
+static void boot_dump_range (BootSession *session)
+{
+	if(session->RX_Data >= 8)
+	{
+		wiznet_receive_tcp(Buffer,8,Sock_Offset);
+		DumpAddress = (uint32_t)Buffer[0] + ((uint32_t)Buffer[1]<<8) + ((uint32_t)Buffer[2]<<16) + ((uint32_t)Buffer[3]<<24);
+		session->DumpRemaining = (uint32_t)Buffer[4] + ((uint32_t)Buffer[5]<<8) + ((uint32_t)Buffer[6]<<16) +
+								 ((uint32_t)Buffer[7]<<24);
+		if(DumpAddress > FLASHEND + 1UL || session->DumpRemaining > FLASHEND + 1UL - DumpAddress)
+		{
+			//not in the flash, drop the connection and listen for the next one, as after a disconnect
+			wiznet_socket_listen(Sock_Offset,Listen_Port);
+			session->status = WAIT_START;
+			return;
+		}
+		DumpPosition = 0;
+		DumpLength = 0;
+		Sec_Timeout = 10;
+		session->status = DUMP;
+	}
+}
+
+//DUMP, send the range from the flash
+static void boot_dump (BootSession *session)
+{
+	//fill the free space of the transmit buffer, up to half of it so the chip is never left waiting for the
+	//ACK of all of it, and unless it is only a sliver of what is left to send
+	uint16_t length = session->TX_Size < DUMP_MAX_SEND ? session->TX_Size : DUMP_MAX_SEND;
+	length = session->DumpRemaining < length ? session->DumpRemaining : length;
+	if(length > 0 && (length == session->DumpRemaining || length >= DUMP_MIN_SEND) && boot_page_ready())
+	{
+		if(wiznet_send_tcp_source(boot_flash_source,length,Sock_Offset) == 0)
+		{
+			//connection must have been lost
+			session->status = END;
+			return;
+		}
+		session->DumpRemaining -= length;
+		Sec_Timeout = 10;	//reset timer
+	}
+	
+	if(session->DumpRemaining == 0)
+	{
+		session->status = WAIT_START;	//the next command
+	}
+}
+#endif
+
+//PROGRAMMING, receive the pages and program them
+static void boot_programming (BootSession *session)
+{
+	//the next page is received while the previous one is erased/written in the background,
+	//once the flash is idle and the pages written have been read back it goes straight to the page buffer
+	uint8_t Direct = boot_page_ready() && !(session->CrcVerify && session->CrcPage < session->PagesStarted);
+	if(!session->BufferFull && session->PageIndex < session->Transfers && SEGMENT_MODE(session))
+	{
+		if(session->SegmentPages == 0 && session->SegmentsLeft == 0)
+		{
+			session->Pages = session->NextPage;		//the image ends with the last segment
+			session->Transfers = session->PageIndex;
+		}
+		else if(session->SegmentPages == 0 && session->RX_Data >= 4)
+		{
+			wiznet_receive_tcp(Buffer,4,Sock_Offset);
+			session->SegmentStart = (uint32_t)Buffer[0] + ((uint32_t)Buffer[1]<<8);
+			session->SegmentPages = Buffer[2] | (Buffer[3] << 8);
+			session->SegmentsLeft--;
+			if(session->SegmentStart < session->NextPage || session->SegmentPages == 0 ||
+			   session->SegmentStart + session->SegmentPages > APP_PAGES)
+			{
+				//overlapping, empty or outside the application section, give up without setting Programmed
+				session->status = END;
+				return;
+			}
+		}
+		else if(session->SegmentPages > 0 && session->NextPage == session->SegmentStart && session->RX_Data > 0 &&
+				boot_page_receive(Buffer,&session->BufferFill,session->RX_Data,Direct))
+		{
+			//the gap before the segment has been erased, its next page is in
+			session->BufferPage = session->NextPage++;
+			session->SegmentStart++;
+			session->SegmentPages--;
+			session->PageIndex++;
+			session->BufferFull = 1;
+		}
+	}
+	else if(!session->BufferFull && session->PageIndex < session->Transfers)
+	{
+		if(DELTA_MODE(session) && !session->RecordIndexValid && session->RX_Data >= 2)
+		{
+			//page index of the next record
+			wiznet_receive_tcp(Buffer,2,Sock_Offset);
+			session->RX_Data -= 2;
+			session->BufferPage = (uint32_t)Buffer[0] + ((uint32_t)Buffer[1]<<8);
+			if(session->BufferPage == 0xFFFF)
+			{
+				session->Transfers = session->PageIndex;	//end of the records
+			}
+			else if(session->BufferPage >= session->Pages || session->BufferPage >= APP_PAGES)
+			{
+				//outside the image or the application section, give up without setting Programmed
+				session->status = END;
+				return;
+			}
+			else
+			{
+				session->RecordIndexValid = 1;
+			}
+		}
+		
+		if((!DELTA_MODE(session) || session->RecordIndexValid) && session->RX_Data > 0 &&
+		   boot_page_receive(Buffer,&session->BufferFill,session->RX_Data,Direct))
+		{
+			if(!DELTA_MODE(session))
+			{
+				session->BufferPage = session->PageIndex;
+			}
+			session->PageIndex++;
+			session->RecordIndexValid = 0;
+			session->BufferFull = 1;
+		}
+	}
+	
+	if(boot_page_ready())
+	{
+		if(session->CrcVerify && session->CrcPage < session->PagesStarted)
+		{
+			//the flash is idle, so the page that just finished can be read back
+			session->ImageCrc = boot_page_crc(session->CrcPage++,session->ImageCrc);
+		}
+		
+		if(session->BufferFull)
+		{
+			//start programming the page
+			if(PageFill == SPM_PAGESIZE)
+			{
+				boot_page_commit(session->BufferPage);	//received straight into the page buffer
+				PageFill = 0;
+			}
+			else
+			{
+				boot_page_start(session->BufferPage,Buffer);
+			}
+			session->BufferFull = 0;
+			if(!DELTA_MODE(session))
+			{
+				//delta records can arrive in any order, they are checked in VERIFY
+				session->PagesStarted = session->BufferPage + 1;
+			}
+		}
+		else if(SEGMENT_MODE(session) && session->SegmentPages > 0 && session->NextPage < session->SegmentStart)
+		{
+			//a page in the gap before the segment, only erased if something is left in it
+			if(!boot_page_erased(session->NextPage))
+			{
+				boot_page_clear(session->NextPage);
+			}
+			session->PagesStarted = ++session->NextPage;
+		}
+		else if(session->PageIndex == session->Transfers) 
+		{
+			//when all pages have been written
+			session->PageIndex = 0;		//reset the index to be used in verifying
+			Sec_Timeout = 10;	//reset timer
+			if(session->CrcVerify)
+			{
+				session->status = VERIFY;	//send the image CRC
+			}
+			else if(DELTA_MODE(session))
+			{
+				//verify with the digests of the new flash contents, instead of sending it all back
+				session->DigestNext = OK;
+				session->status = DIGEST;
+			}
+			else
+			{
+				session->status = VERIFY;	//Go to verify case
+			}
+		}
+	}
+}
+
+//VERIFY, send the pages or the CRC of the image back
+static void boot_verify (BootSession *session)
+{
+	if(session->CrcVerify)
+	{
+		//fold in the pages that are left, a few per pass so the timeout keeps running
+		for(uint8_t i = 0; i < 16 && session->CrcPage < session->Pages; i++)
+		{
+			session->ImageCrc = boot_page_crc(session->CrcPage++,session->ImageCrc);
+		}
+		
+		if(session->CrcPage == session->Pages && session->TX_Size >= 4)
+		{
+			uint32_t digest = crc32_final(session->ImageCrc);
+			Buffer[0] = digest & 0xFF;
+			Buffer[1] = (digest >> 8) & 0xFF;
+			Buffer[2] = (digest >> 16) & 0xFF;
+			Buffer[3] = (digest >> 24) & 0xFF;
+			if(wiznet_send_tcp(Buffer,4,Sock_Offset) == 0)
+			{
+				//connection must have been lost
+				session->status = END;
+				return;
+			}
+			Sec_Timeout = 10;	//reset timer
+			session->status = OK;
+		}
+		return;
+	}
+	
+	//check there is enough room in the transmit buffer for a full page
+	if(session->TX_Size >= SPM_PAGESIZE)
+	{
+		//read a full page then transmit it over TCP
+		boot_read_page(session->PageIndex,Buffer);
+		int16_t bytes_written = wiznet_send_tcp(Buffer,SPM_PAGESIZE,Sock_Offset);
+		if(bytes_written == 0)
+		{
+			//connection must have been lost
+			session->status = END;
+		}
+		session->PageIndex++;
+	}
+
+	if(session->PageIndex == session->Pages)
+	{
+		//wait for the OK message
+		Sec_Timeout = 10;	//reset timer
+		session->status = OK;
+	}
+}
+
+//OK, the host's verdict on the image
+static void boot_ok (BootSession *session)
+{
+	if(session->RX_Data >= 2)
+	{
+		wiznet_receive_tcp(Buffer,2,Sock_Offset);
+		if(Buffer[0] == 'O' && Buffer[1] == 'K')
+		{
+			eeprom_write_byte(&Eeprom.Programmed,0x01); //Program is OK, set Programmed byte
+			session->ExitReason = BOOT_EXIT_PROGRAMMED;
+			Sec_Timeout = 10; //reset the timeout
+			session->status = END;
+		}
+		else if(Buffer[0] == 'S' && Buffer[1] == 'T')
+		{
+			//STAT before OK, the counters of the session that has just been verified
+			//(no version reply, the host already has it), then OK is still expected
+			session->StatTail = 1;
+			session->StatNext = OK;
+			session->status = STAT;
+		}
+	}
+}
+
+//STAT, send the performance counters
+static void boot_stat (BootSession *session)
+{
+	if(session->StatTail && session->RX_Data >= 2)
+	{
+		wiznet_receive_tcp(Buffer,2,Sock_Offset);
+		session->StatTail = 0;
+		if(Buffer[0] != 'A' || Buffer[1] != 'T')
+		{
+			session->status = session->StatNext;
+		}
+	}
+	else if(!session->StatTail && session->TX_Size >= STAT_RECORD_LENGTH)
+	{
+		if(wiznet_send_tcp(Buffer,stat_record(Buffer),Sock_Offset) == 0)
+		{
+			session->status = END;	//connection must have been lost
+			return;
+		}
+		session->status = session->StatNext;
+	}
+}
+
+//END, start the application, or wait for another upload if there is none
+static void boot_end (BootSession *session)
+{
+	if(eeprom_read_byte(&Eeprom.Programmed))
+	{
+		//if MCU is successfully programmed
+		//Jump to the application
+		boot_exit(session->ExitReason);
+	}
+	else
+	{
+		//there was an error with programming
+		//don't try to run code
+		//wait for a new program to be uploaded, once the last page has been written
+		//(the next session starts by writing the EEPROM, which can't be done while the flash is busy)
+		while(!boot_page_ready())
+		{
+			boot_spm_busy_wait();
+		}
+		boot_page_abandon();
+		session->status = WAIT_START;
+		session->ExitReason = BOOT_EXIT_TIMEOUT;
+		Sec_Timeout = 10;
 	}
 }
 
@@ -107,10 +1418,25 @@ int main(void)
 	//to ensure the MCU does not get stuck in a reset loop
 	
 	cli();				//Disable all interrupts
+	uint8_t ResetCause = MCUSR;
 	MCUSR = 0;			//Clear the MCU Status Register, this removes any reset condition flags
 	wdt_disable();		//Disable the watchdog timer
 	
+	//A staged image is installed before anything else, then started like any verified application
+	uint8_t Reason = boot_stage_install() ? BOOT_EXIT_STAGED : BOOT_EXIT_FAST_BOOT;
 	
+	//Fast boot, a verified application is started straight away, without touching the W5100, unless it
+	//has asked for the boot loader or the reset button was pressed (the way in for an application that can't ask)
+	uint8_t ResetButton = (ResetCause & (1<<EXTRF)) && !(ResetCause & (1<<PORF));
+	uint8_t Requested = BootRequest == BOOT_REQUEST_MAGIC || eeprom_read_byte(&Eeprom.EnterBootloader);
+	if(eeprom_read_byte(&Eeprom.Programmed) && !Requested && !ResetButton)
+	{
+		boot_exit(Reason);
+	}
+	if(eeprom_read_byte(&Eeprom.EnterBootloader))
+	{
+		eeprom_write_byte(&Eeprom.EnterBootloader,0x00);
+	}
 	
 	DDRB |= 1<<7;		//Set PortB 7 as output
 						//This pin has an LED connected, that is flashed to indicate the bootloader is running
@@ -123,16 +1449,17 @@ int main(void)
 	DDRG |= (1<<PG5);				//Set PG5 as output
 	PORTG |= (1<<PG5);				//Set high to deselect SD card
 	
-	_delay_ms(200);		//loop doing nothing for 200ms,
-						//to give the Wiznet chip some time to startup after a cold boot
-	
 	//Read the IP Settings from EEPROM into sram
 	read_IP_EEPROM(gateway_ip,subnet_mask,mac_address,device_ip_address);
 	
-	//Setup the Wiznet Ethernet Chip
-	wiznet_init();
-	wiznet_set_config(gateway_ip,subnet_mask,mac_address,device_ip_address);
-	wiznet_socket_listen(Sock_Offset,Listen_Port);	//Setup a TCP listener port
+	//Setup the Wiznet Ethernet Chip, wiznet_init waits for it to start up after a cold boot
+	network_listen_tcp();
+	
+	DDRE &= ~(1<<PE4);							//W5100 INT is an input
+	PORTE |= (1<<PE4);							//with the pull-up, in case the jumper is not fitted
+	EICRB &= ~((1<<ISC41) | (1<<ISC40));		//INT4 on a low level
+	EIMSK |= (1<<INT4);
+	set_sleep_mode(SLEEP_MODE_IDLE);			//idle keeps the timers running
 	
 	Sec_Timeout = 10;	//Set the timeout value, when this expires, boot loader will jump to main code
 	
@@ -141,28 +1468,26 @@ int main(void)
 	TCCR1C = 0x00;
 	OCR1A = 15625;			//Set compare register to 15625 to give a 1Hz interrupt
 	TIMSK1 = (1<<OCIE1A);	//enable output compare interrupt enable
+	
+	TCCR3A = 0x00;
+	TCCR3B = (1<<CS32);		//TIMER3 free running at clk/256 for the performance counters, no interrupts
 		
 	sei(); //Global enable interrupts
 	
-	enum {WAIT_START, HEADER, PROGRAMMING, VERIFY, OK, END, IPSET} status;
-	status = WAIT_START;
-	
-	
-	//buffer for ethernet communication
-	//same size as a page, allowing reading/writing one page at a time
-	uint8_t Buffer[SPM_PAGESIZE]; 
-	
-	uint32_t PageIndex = 0;	//current active page
-	uint32_t Pages = 0;		//total pages to verify/write
+	BootSession Session = {.status = WAIT_START, .DigestNext = OK, .StatNext = WAIT_START,
+						   .ExitReason = BOOT_EXIT_TIMEOUT, .ImageCrc = CRC32_INIT, .FlagsStale = 1};
+	uint16_t PassTick = stat_ticks();
 	
     while(1)
     {
+		BOOT_LOOP_PASS();
+		
 		
 		if(Sec_Timeout == 0)
 		{
 			//if timeout exceeded then
 			//set case to END
-			status = END;
+			Session.status = END;
 			
 			//Flash the LED fast to signal bootloader exit
 			for(uint8_t i = 0; i< 10; i++)
@@ -174,190 +1499,96 @@ int main(void)
 			}
 		}
 
-		unsigned short RX_Data = wiznet_Rx_size(Sock_Offset);	//Get the amount of data in the receive buffer
-		unsigned short TX_Size = wiznet_Tx_size(Sock_Offset);	//Get the free space in the transmit buffer
+		boot_socket_events(&Session);
 		
-		switch (status)
+		uint8_t PassStatus = Session.status;
+		uint32_t PassReadback = Stats.readback_ticks;
+		
+		switch (Session.status)
 		{
 			case WAIT_START:
-			{
-				if(RX_Data >= 4)
-				{
-					//Must receive a PROG command to start the process of writing a new application
-					wiznet_receive_tcp(Buffer,4,Sock_Offset);
-					if(Buffer[0] == 'P' && Buffer[1] == 'R' && Buffer[2] == 'O' && Buffer[3] == 'G')
-					{
-						unsigned char Version_Reply[] = "V1.0\r\n";			//send the version of the logger/bootloader
-						wiznet_send_tcp(Version_Reply,6,Sock_Offset);		//5 bytes to include the null termination
-						Sec_Timeout = 10;									//reset the timeout to 10 seconds
-						status = HEADER;
-					}
-					else if(Buffer[0] == 'I' && Buffer[1] == 'P' && Buffer[2] == 'S' && Buffer[3] == 'T')
-					{
-						unsigned char Version_Reply[] = "V1.0\r\n";			//send the version of the logger/bootloader
-						wiznet_send_tcp(Version_Reply,6,Sock_Offset);		//5 bytes to include the null termination
-						Sec_Timeout = 10;									//reset the timeout to 10 seconds
-						status = IPSET;
-					}
-				}
+				boot_wait_start(&Session);
 				break;
-			}
-			case IPSET: //update the TCP/IP settings
-			{
-				if(RX_Data >= 18) //wait for full TCP/IP settings packet
-				{
-					wiznet_receive_tcp(Buffer,18,Sock_Offset);
-								
-					//Packet Structure - 18 bytes
-					//----------------------
-					//Packet[0-3] - GateIP 4 bytes
-					//Packet[4-7] - SubMask 4 bytes
-					//Packet[8-13] - MacAdd 6 bytes
-					//Packet[14-17] - DeviceIP 4 bytes
-					//----------------------
-								
-					//copy packet data into correct arrays
-					for (int i = 0; i< 6; i++)
-					{
-						if(i < 4)
-						{
-							gateway_ip[i] = Buffer[i];
-							subnet_mask[i] = Buffer[i+4];
-							device_ip_address[i] = Buffer[i+14];
-						}
-						mac_address[i] = Buffer[i+8];
-					}
-								
-					write_IP_EEPROM(gateway_ip,subnet_mask,mac_address,device_ip_address);
-								
-					Sec_Timeout = 0; //set timeout to zero to restart the MCU and load new IP settings
-					status = WAIT_START;
-				}
+			case IPSET:
+				boot_ipset(&Session);
 				break;
-			}
 			case HEADER:
-			{
-				if(RX_Data >= 4)
-				{
-					//the header is a 32bit value (4 bytes) that indicates the amount of pages to be written
-					wiznet_receive_tcp(Buffer,4,Sock_Offset);
-					Pages = (uint32_t)Buffer[0] + ((uint32_t)Buffer[1]<<8) + ((uint32_t)Buffer[2]<<16) + ((uint32_t)Buffer[3]<<24);
-					
-					//clear the programmed status, as the program can no longer be guaranteed to be OK
-					eeprom_write_byte(&Programmed,0x00); 
-					Sec_Timeout = 10; //reset the timeout
-					status = PROGRAMMING;
-				}
+				boot_header(&Session);
 				break;
-			}
+			case DIGEST:
+				boot_digest(&Session);
+				break;
+#if BOOT_DUMP
+			case DUMP_RANGE:
+				boot_dump_range(&Session);
+				break;
+			case DUMP:
+				boot_dump(&Session);
+				break;
+#else
+			case DUMP_RANGE:
+			case DUMP:
+				break;
+#endif
 			case PROGRAMMING:
-			{
-				//check there is a full page ready in the receive buffer
-				if(RX_Data >= SPM_PAGESIZE)
-				{
-					//write one page at a time and increment the page index
-					wiznet_receive_tcp(Buffer,SPM_PAGESIZE,Sock_Offset);
-					boot_program_page(PageIndex,Buffer);
-					PageIndex++;
-				}
-				
-				if(PageIndex == Pages) 
-				{
-					//when all pages have been written
-					PageIndex = 0;		//reset the index to be used in verifying
-					Sec_Timeout = 10;	//reset timer
-					status = VERIFY;	//Go to verify case
-					break;
-				}
-				
+				boot_programming(&Session);
 				break;
-			}
 			case VERIFY:
-			{
-				//check there is enough room in the transmit buffer for a full page
-				if(TX_Size >= SPM_PAGESIZE)
-				{
-					//read a full page then transmit it over TCP
-					boot_read_page(PageIndex,Buffer);
-					int16_t bytes_written = wiznet_send_tcp(Buffer,SPM_PAGESIZE,Sock_Offset);
-					if(bytes_written == 0)
-					{
-						//connection must have been lost
-						status = END;
-					}
-					PageIndex++;
-				}
-
-				if(PageIndex == Pages)
-				{
-					//wait for the OK message
-					Sec_Timeout = 10;	//reset timer
-					status = OK;
-				}
+				boot_verify(&Session);
 				break;
-			}
 			case OK:
-			{
-				if(TX_Size >= 2)
-				{
-					wiznet_receive_tcp(Buffer,2,Sock_Offset);
-					if(Buffer[0] == 'O' && Buffer[1] == 'K')
-					{
-						eeprom_write_byte(&Programmed,0x01); //Program is OK, set Programmed byte
-						Sec_Timeout = 10; //reset the timeout
-						status = END;
-					}
-				}
+				boot_ok(&Session);
+				break;
+			case STAT:
+				boot_stat(&Session);
 				break;
-			}
 			case END:
+				boot_end(&Session);
+				break;
+		}
+		
+		//one commit of the socket pointers for everything read and sent in this pass,
+		//then charge the time of the pass to what it was waiting for, if it did nothing
+		uint8_t Moved = wiznet_commit();
+		uint16_t PassTicks = stat_ticks() - PassTick;
+		PassTick += PassTicks;
+		Stats.run_ticks += PassTicks;
+		if(!Moved && PassReadback == Stats.readback_ticks)
+		{
+			if(FlashState != FLASH_IDLE)
 			{
-				if(eeprom_read_byte(&Programmed))
-				{
-					//Disable all interrupts
-					cli();
-									
-					//reset the ports
-					PORTB = 0x00;
-					DDRB = 0x00;
-					PORTG = 0x00;
-					DDRG = 0x00;
-									
-					//Reset SPI registers
-					SPCR = 0x00;
-					SPSR = 0x00;
-									
-					//reset Timer settings
-					TCCR1A = 0x00;
-					TCCR1B = 0x00;
-					TCCR1C = 0x00;
-					OCR1A = 0x00;
-					TIMSK1 = 0x00;
-									
-					//Put interrupt vectors back in main flash land
-					//these two writes must occur within 4 cycles
-					MCUCR = (1<<IVCE);
-					MCUCR = 0;
-									
-					// enable the main flash for use by the main application
-					boot_rww_enable ();
-					//if MCU is successfully programmed
-					//Jump to the application
-					asm("jmp 0000");
-				}
-				else
-				{
-					//there was an error with programming
-					//don't try to run code
-					//wait for a new program to be uploaded
-					status = WAIT_START;
-					Sec_Timeout = 10;
-					break;
-				}
-				
-
+				Stats.flash_wait_ticks += PassTicks;
+			}
+			else if(Session.status == DIGEST || Session.status == VERIFY || Session.status == STAT ||
+					Session.status == DUMP)
+			{
+				Stats.tx_wait_ticks += PassTicks;
+			}
+			else
+			{
+				Stats.rx_wait_ticks += PassTicks;
 			}
 		}
-
+		
+		if(Moved)
+		{
+			Session.FlagsStale = 1;		//data was read or sent, look for more
+		}
+		else if(Session.status == PassStatus &&
+				(Session.status == WAIT_START || Session.status == IPSET || Session.status == HEADER ||
+				 Session.status == OK || Session.status == DUMP_RANGE || (Session.status == STAT && Session.StatTail)))
+		{
+			//nothing happened and the state is waiting for the host,
+			//sleep until the W5100 or the one second timer interrupts
+			cli();
+			if(!WiznetEvent)
+			{
+				sleep_enable();
+				sei();
+				sleep_cpu();	//the instruction after sei always runs, so no interrupt is taken before sleeping
+				sleep_disable();
+			}
+			sei();
+		}
     }
 }
\ No newline at end of file
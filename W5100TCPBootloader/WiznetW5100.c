@@ -2,8 +2,19 @@
 #include "WiznetW5100.h"
 #include <avr/io.h>
 #include <util/delay.h>
+#include <stddef.h>
 
+//Hardware access used by every SPI transfer to the W5100
+//a host build (see HostSim) defines these before this file is compiled, to run the driver against a model of the chip
+#ifndef WIZNET_SELECT
+#define WIZNET_SELECT()			(PORTB &= ~(1<<PB4))		//Chip select, W5100 /SCS is on PB4
+#define WIZNET_DESELECT()		(PORTB |= (1<<PB4))			//Chip deselect
+#define WIZNET_SPI_WRITE(data)	(SPDR = (data))				//Put data in SPI Data Register, starts the transfer
+#define WIZNET_SPI_WAIT()		while(!(SPSR & (1<<SPIF)))	//wait for transmission to finish
+#define WIZNET_SPI_READ()		(SPDR)						//Retrieve the reply data from data register
+#endif
 
+WiznetCounters wiznet_counters;
 
 unsigned char exchange_SPI(unsigned char send_data) 
 {
@@ -11,9 +22,9 @@ unsigned char exchange_SPI(unsigned char send_data)
 	//sends a byte then waits for transmission, then reads a byte
 	
 	unsigned char recv_data;
-	SPDR = send_data;			//Put data in SPI Data Register
-	while(!(SPSR & (1<<SPIF))); //wait for transmission to finish
-	recv_data = SPDR;			//Retrieve the reply data from data register
+	WIZNET_SPI_WRITE(send_data);	//Put data in SPI Data Register
+	WIZNET_SPI_WAIT();				//wait for transmission to finish
+	recv_data = WIZNET_SPI_READ();	//Retrieve the reply data from data register
 	return recv_data;
 }
 
@@ -23,7 +34,8 @@ unsigned char wiznet_read_address(unsigned short address)
 	//reads a byte from a 16bit register on the W5100 ethernet chip
 	
 	unsigned char data;
-	PORTB &= ~(1<<PB4);						//Chip select
+	wiznet_counters.spi_frames++;
+	WIZNET_SELECT();							//Chip select
 	exchange_SPI(0x0F);						//read address command
 	
 	exchange_SPI((address & 0xFF00) >> 8);  //send 16bit address
@@ -31,7 +43,7 @@ unsigned char wiznet_read_address(unsigned short address)
 	
 	data = exchange_SPI(0x00);				//read the byte, 0x00 is dummy data to drive the SPI clock
 	
-	PORTB |= (1<<PB4);						//Chip deselect
+	WIZNET_DESELECT();						//Chip deselect
 	
 	return data;
 }
@@ -41,7 +53,8 @@ void wiznet_write_address(unsigned short address,unsigned char data )
 	//Private function that is not exposed in header
 	//write a byte to a 16bit register on the W5100 ethernet chip
 	
-	PORTB &= ~(1<<PB4);						//Chip select
+	wiznet_counters.spi_frames++;
+	WIZNET_SELECT();							//Chip select
 	
 	exchange_SPI(0xF0);						//write address command
 	
@@ -50,7 +63,7 @@ void wiznet_write_address(unsigned short address,unsigned char data )
 			
 	exchange_SPI(data);						//send data byte
 	
-	PORTB |= (1<<PB4);						//Chip deselect
+	WIZNET_DESELECT();						//Chip deselect
 	
 	return;
 }
@@ -58,31 +71,97 @@ void wiznet_write_address(unsigned short address,unsigned char data )
 void wiznet_set_config(const unsigned char gateway_ip[4], const unsigned char subnet_mask[4],
 					   const unsigned char mac_address[6], const unsigned char device_ip_address[4])
 {
+	//the network registers are consecutive, Gateway IP 0x0001-0x0004, Subnet Mask 0x0005-0x0008,
+	//MAC Address 0x0009-0x000E and Device IP 0x000F-0x0012, so the fields are written as one run from a table
+	const unsigned char *fields[4] = {gateway_ip,subnet_mask,mac_address,device_ip_address};
+	unsigned short address = 0x0001;
+	for(unsigned char i = 0; i < 4; i++)
+	{
+		unsigned char length = i == 2 ? 6 : 4;
+		wiznet_write_block(address,fields[i],length);
+		address += length;
+	}
+}
 
-	wiznet_write_address(0x0001,gateway_ip[0]);
-	wiznet_write_address(0x0002,gateway_ip[1]);
-	wiznet_write_address(0x0003,gateway_ip[2]);
-	wiznet_write_address(0x0004,gateway_ip[3]);
-	
-	wiznet_write_address(0x0005,subnet_mask[0]);
-	wiznet_write_address(0x0006,subnet_mask[1]);
-	wiznet_write_address(0x0007,subnet_mask[2]);
-	wiznet_write_address(0x0008,subnet_mask[3]);
-	
-	wiznet_write_address(0x0009,mac_address[0]);
-	wiznet_write_address(0x000A,mac_address[1]);
-	wiznet_write_address(0x000B,mac_address[2]);
-	wiznet_write_address(0x000C,mac_address[3]);
-	wiznet_write_address(0x000D,mac_address[4]);
-	wiznet_write_address(0x000E,mac_address[5]);
-	
-	wiznet_write_address(0x000F,device_ip_address[0]);
-	wiznet_write_address(0x0010,device_ip_address[1]);
-	wiznet_write_address(0x0011,device_ip_address[2]);
-	wiznet_write_address(0x0012,device_ip_address[3]);
+#ifndef WIZNET_SOCKET
+//socket buffer memory, worked out from the RMSR/TMSR layout in wiznet_init
+//base is the W5100 address of the sockets buffer, mask is the buffer size - 1
+static unsigned short Rx_Base[4], Rx_Mask[4];
+static unsigned short Tx_Base[4], Tx_Mask[4];
+#endif
+
+//SRAM copy of each sockets status and buffer pointers, loaded from the chip on the first transfer after the
+//socket was opened or its connection changed (CON, DISCON and TIMEOUT in wiznet_socket_interrupts), so a
+//transfer costs no register reads. Reads and sends only move the copy, wiznet_commit writes it back
+//the buffer sizes are kept too, for the sockets whose interrupts are enabled: reads and sends take off them
+//and they are read again once Sn_IR shows RECV (more received) or SEND_OK (more room to send)
+#define WIZNET_PENDING_RECV 0x01
+#define WIZNET_PENDING_SEND 0x02
+#define WIZNET_STALE_RX 0x01
+#define WIZNET_STALE_TX 0x02
+typedef struct
+{
+	unsigned short rx_rd;		//Sn_RX_RD
+	unsigned short tx_wr;		//Sn_TX_WR
+	unsigned short rx_size;		//Sn_RX_RSR, less what has been read since
+	unsigned short tx_free;		//Sn_TX_FSR, less what has been sent since
+	unsigned char status;		//Sn_SR
+	unsigned char valid;
+	unsigned char pending;		//WIZNET_PENDING_ flags, pointers still to be written back
+	unsigned char stale;		//WIZNET_STALE_ flags, sizes to read from the chip
+} WiznetShadow;
+
+//Socket selection, a build with WIZNET_SOCKET (see WiznetW5100.h) has a single socket, whose register offset,
+//buffer base and mask and shadow are constants, the offset passed in is not used
+#ifdef WIZNET_SOCKET
+#if WIZNET_MEM_START(WIZNET_RX_LAYOUT, WIZNET_SOCKET) + WIZNET_MEM_SIZE(WIZNET_RX_LAYOUT, WIZNET_SOCKET) > 0x2000 || \
+	WIZNET_MEM_START(WIZNET_TX_LAYOUT, WIZNET_SOCKET) + WIZNET_MEM_SIZE(WIZNET_TX_LAYOUT, WIZNET_SOCKET) > 0x2000
+#error "WIZNET_SOCKET gets no buffer memory in WIZNET_RX_LAYOUT or WIZNET_TX_LAYOUT"
+#endif
+#define SOCKET_SHADOWS 1
+#define SOCKET_OFFSET(offset) ((unsigned short)(WIZNET_SOCKET) << 8)
+#define SOCKET_SHADOW(offset) (&Shadow[0])
+#define RX_BASE(offset) (0x6000 + WIZNET_MEM_START(WIZNET_RX_LAYOUT, WIZNET_SOCKET))
+#define RX_MASK(offset) (WIZNET_MEM_SIZE(WIZNET_RX_LAYOUT, WIZNET_SOCKET) - 1)
+#define TX_BASE(offset) (0x4000 + WIZNET_MEM_START(WIZNET_TX_LAYOUT, WIZNET_SOCKET))
+#define TX_MASK(offset) (WIZNET_MEM_SIZE(WIZNET_TX_LAYOUT, WIZNET_SOCKET) - 1)
+#else
+#define SOCKET_SHADOWS 4
+#define SOCKET_OFFSET(offset) (offset)
+#define SOCKET_SHADOW(offset) (&Shadow[(offset) >> 8])
+#define RX_BASE(offset) Rx_Base[(offset) >> 8]
+#define RX_MASK(offset) Rx_Mask[(offset) >> 8]
+#define TX_BASE(offset) Tx_Base[(offset) >> 8]
+#define TX_MASK(offset) Tx_Mask[(offset) >> 8]
+#endif
+#define SOCKET_BIT(offset) (1 << (SOCKET_OFFSET(offset) >> 8))
+
+static WiznetShadow Shadow[SOCKET_SHADOWS];
+static unsigned char Interrupt_Mask;	//IMR, the sockets whose Sn_IR is read by wiznet_socket_interrupts
+
+static void wiznet_commit_socket(unsigned short offset);
+
+#ifndef WIZNET_SOCKET
+static void wiznet_buffer_layout(unsigned char layout, unsigned short memory, unsigned short base[4], unsigned short mask[4])
+{
+	//the W5100 hands out its 8KB of RX (or TX) memory in socket order, 2 bits per socket select 1, 2, 4 or 8KB
+	//sockets that no longer fit get no memory, they are given a mask of 0 and must not be used
+	unsigned short offset = 0;
+	for(unsigned char socket = 0; socket < 4; socket++)
+	{
+		unsigned short size = 0x0400 << ((layout >> (socket*2)) & 0x03);
+		if(offset + size > 0x2000)
+		{
+			size = 0;
+		}
+		base[socket] = memory + offset;
+		mask[socket] = size ? size - 1 : 0;
+		offset += size;
+	}
 }
+#endif
 
-void wiznet_init(void)
+void wiznet_init(unsigned char rx_layout, unsigned char tx_layout)
 {
 	//WizNet W5100 Ethernet Chip Select is on PB4
 	DDRB |= (1<<PB4);				//set PB4 as output
@@ -102,31 +181,121 @@ void wiznet_init(void)
 	SPSR = (1<<SPI2X);				//Set SPI Double Speed, making speed OSC/2 (8MHz, using 16MHz external clock) 					
 	
 	
-	wiznet_write_address(0x0000,0x80); //Write Reset CMD to Wiznet CMD register
+	//after a cold boot the W5100 does not answer until its PLL has locked (about 10ms), poll a register
+	//that can be written (GAR0, set again by wiznet_set_config) until it reads back, for at most 200ms
+	for(unsigned char i = 0; i < 200; i++)
+	{
+		wiznet_write_address(0x0001,0xA5);
+		if(wiznet_read_address(0x0001) == 0xA5)
+		{
+			break;
+		}
+		_delay_ms(1);
+	}
 	
+	wiznet_write_address(0x0000,0x80); //Write Reset CMD to Wiznet CMD register
+	//the reset bit clears itself when the reset is complete, wait for it no longer than for the PLL above so a
+	//missing or broken chip cannot hang the boot loader, the listen timeout then ends it as usual
+	for(unsigned char i = 0; i < 200; i++)
+	{
+		if(!(wiznet_read_address(0x0000) & 0x80))
+		{
+			break;
+		}
+		_delay_ms(1);
+	}
 	
+	//socket memory sizes, RX (RMSR) at 0x6000 and TX (TMSR) at 0x4000
+#ifdef WIZNET_SOCKET
+	(void)rx_layout;
+	(void)tx_layout;
+	const unsigned char layout[2] = {WIZNET_RX_LAYOUT, WIZNET_TX_LAYOUT};
+#else
+	const unsigned char layout[2] = {rx_layout, tx_layout};
+	wiznet_buffer_layout(rx_layout,0x6000,Rx_Base,Rx_Mask);
+	wiznet_buffer_layout(tx_layout,0x4000,Tx_Base,Tx_Mask);
+#endif
+	wiznet_write_block(0x001A,layout,2);
+	
+	for(unsigned char socket = 0; socket < SOCKET_SHADOWS; socket++)
+	{
+		Shadow[socket].valid = 0;
+		Shadow[socket].pending = 0;
+		Shadow[socket].stale = WIZNET_STALE_RX | WIZNET_STALE_TX;
+	}
+	Interrupt_Mask = 0;
 }
 
+static void wiznet_shadow_invalidate(unsigned short offset)
+{
+	//the socket has been opened, closed or (dis)connected, reload the shadow before the next transfer
+	//anything read or sent and not yet committed is dropped with the old connection
+	WiznetShadow *shadow = SOCKET_SHADOW(offset);
+	shadow->valid = 0;
+	shadow->pending = 0;
+	shadow->stale = WIZNET_STALE_RX | WIZNET_STALE_TX;
+}
 
+static WiznetShadow *wiznet_shadow(unsigned short offset)
+{
+	WiznetShadow *shadow = SOCKET_SHADOW(offset);
+	if(!shadow->valid)
+	{
+		unsigned char pointer[2];
+		wiznet_commit_socket(offset);	//what was pending before the connection changed
+		shadow->status = wiznet_read_address(0x0403+SOCKET_OFFSET(offset));
+		wiznet_read_block(0x0424+SOCKET_OFFSET(offset),pointer,2);		//Sn_TX_WR
+		shadow->tx_wr = (pointer[0] << 8) | pointer[1];
+		wiznet_read_block(0x0428+SOCKET_OFFSET(offset),pointer,2);		//Sn_RX_RD
+		shadow->rx_rd = (pointer[0] << 8) | pointer[1];
+		shadow->valid = 1;
+	}
+	return shadow;
+}
+
+static unsigned short wiznet_read_size(unsigned short address)
+{
+	//RX_RSR and TX_FSR change while the chip receives and sends, the datasheet has them read until two
+	//readings agree. The msb is read again after the lsb, if it is unchanged the pair was read consistently
+	//(a change of the lsb alone gives a value the register really had), one frame less than reading both twice
+	unsigned char msb = wiznet_read_address(address);
+	while(1)
+	{
+		unsigned char lsb = wiznet_read_address(address+1);
+		unsigned char check = wiznet_read_address(address);
+		if(check == msb)
+		{
+			return (msb << 8) | lsb;
+		}
+		msb = check;
+	}
+}
 
 unsigned short wiznet_Rx_size(unsigned short Socket_offset)
 {
-	//read size of data in receive buffer, which is stored in 2 bytes,
-	//making a 16bit unsigned value
-	unsigned char msb = wiznet_read_address(0x0426+Socket_offset);
-	unsigned char lsb = wiznet_read_address(0x0427+Socket_offset);
-	unsigned short rx_size = ((msb & 0x00ff)<<8) + lsb; 
-	return rx_size;
+	//size of the data in the receive buffer, less what has been read
+	WiznetShadow *shadow = SOCKET_SHADOW(Socket_offset);
+	if((shadow->stale & WIZNET_STALE_RX) || !(Interrupt_Mask & SOCKET_BIT(Socket_offset)))
+	{
+		//committed first, so the chip's size agrees with the shadowed read pointer
+		wiznet_commit_socket(Socket_offset);
+		shadow->rx_size = wiznet_read_size(0x0426+SOCKET_OFFSET(Socket_offset));
+		shadow->stale &= ~WIZNET_STALE_RX;
+	}
+	return shadow->rx_size;
 }
 
 unsigned short wiznet_Tx_size(unsigned short offset)
 {
-	//read size of available space in transmit buffer,
-	//which is stored in 2 bytes, making a 16bit unsigned value
-	unsigned char msb = wiznet_read_address(0x0420+offset);
-	unsigned char lsb = wiznet_read_address(0x0421+offset);
-	unsigned short tx_buffer = ((msb & 0x00ff)<<8) + lsb;
-	return tx_buffer;
+	//free space in the transmit buffer, less what has been sent
+	WiznetShadow *shadow = SOCKET_SHADOW(offset);
+	if((shadow->stale & WIZNET_STALE_TX) || !(Interrupt_Mask & SOCKET_BIT(offset)))
+	{
+		wiznet_commit_socket(offset);
+		shadow->tx_free = wiznet_read_size(0x0420+SOCKET_OFFSET(offset));
+		shadow->stale &= ~WIZNET_STALE_TX;
+	}
+	return shadow->tx_free;
 }
 
 void wiznet_socket_listen(unsigned short offset, unsigned short port)
@@ -136,79 +305,301 @@ void wiznet_socket_listen(unsigned short offset, unsigned short port)
 	source_port[0] = (port >> 8) & 0xFF;
 	source_port[1] = port & 0xFF;
 
-	wiznet_write_address(0x0400+offset,0x01); //set socket to tcp mode
+	wiznet_shadow_invalidate(offset);
+	wiznet_write_address(0x0401+SOCKET_OFFSET(offset),0x10); //close whatever the socket was doing
+	wiznet_write_address(0x0400+SOCKET_OFFSET(offset),0x01); //set socket to tcp mode
 	
-	wiznet_write_address(0x0404+offset,source_port[0]); //write the 2 bytes to the source port registers
-	wiznet_write_address(0x0405+offset,source_port[1]);
+	wiznet_write_block(0x0404+SOCKET_OFFSET(offset),source_port,2); //write the 2 bytes to the source port registers
 	
-	wiznet_write_address(0x0401+offset,0x01); //open
-	wiznet_write_address(0x0401+offset,0x02); //Listen
+	wiznet_write_address(0x0401+SOCKET_OFFSET(offset),0x01); //open
+	wiznet_write_address(0x0401+SOCKET_OFFSET(offset),0x02); //Listen
 	
 }
 
+void wiznet_socket_close(unsigned short offset)
+{
+	wiznet_shadow_invalidate(offset);
+	wiznet_write_address(0x0401+SOCKET_OFFSET(offset),0x10); //close
+	wiznet_write_address(0x0402+SOCKET_OFFSET(offset),0x1F); //clear the interrupt flags, so INT is released
+}
 
-unsigned short wiznet_send_tcp(unsigned char* data, unsigned short data_size,unsigned short socket)
+unsigned char wiznet_socket_status(unsigned short offset)
 {
-	//returns the amount of bytes written to the W5100 chip
+	return wiznet_read_address(0x0403+SOCKET_OFFSET(offset));
+}
+
+static unsigned char Data_Moved;	//see wiznet_commit
+
+void wiznet_interrupt_enable(unsigned char socket_mask)
+{
+	wiznet_write_address(0x0016,socket_mask & 0x0F);	//IMR, bits 0-3 are the sockets
+	Interrupt_Mask = socket_mask & 0x0F;
+}
+
+unsigned char wiznet_socket_interrupts(unsigned short offset)
+{
+	//the flags are cleared by writing 1 to them, flags set after the read stay set and keep INT low
+	unsigned char flags = wiznet_read_address(0x0402+SOCKET_OFFSET(offset));
+	if(flags)
+	{
+		wiznet_write_address(0x0402+SOCKET_OFFSET(offset),flags);
+	}
+	WiznetShadow *shadow = SOCKET_SHADOW(offset);
+	if(flags & (WIZNET_IR_CON | WIZNET_IR_DISCON | WIZNET_IR_TIMEOUT))
+	{
+		shadow->valid = 0;	//the status has changed, anything pending is still committed
+		shadow->stale = WIZNET_STALE_RX | WIZNET_STALE_TX;
+	}
+	if(flags & WIZNET_IR_RECV)
+	{
+		shadow->stale |= WIZNET_STALE_RX;
+	}
+	if(flags & WIZNET_IR_SEND_OK)
+	{
+		shadow->stale |= WIZNET_STALE_TX;
+	}
+	return flags;
+}
+
+static void wiznet_commit_socket(unsigned short offset)
+{
+	//write the pointers of the transfers since the last commit back to the chip, one RECV and one SEND
+	//however many reads and sends there were
+	WiznetShadow *shadow = SOCKET_SHADOW(offset);
+	if(shadow->pending & WIZNET_PENDING_RECV)
+	{
+		unsigned char pointer[2] = {shadow->rx_rd >> 8, shadow->rx_rd & 0xFF};
+		wiznet_write_block(0x0428+SOCKET_OFFSET(offset),pointer,2);
+		wiznet_write_address(0x0401+SOCKET_OFFSET(offset),0x40);	//RECV, frees the data that has been read
+	}
+	if(shadow->pending & WIZNET_PENDING_SEND)
+	{
+		unsigned char pointer[2] = {shadow->tx_wr >> 8, shadow->tx_wr & 0xFF};
+		wiznet_write_block(0x0424+SOCKET_OFFSET(offset),pointer,2);
+		wiznet_write_address(0x0401+SOCKET_OFFSET(offset),0x20);	//SEND, transmits everything up to the write pointer
+	}
+	shadow->pending = 0;
+}
+
+unsigned char wiznet_commit(void)
+{
+	for(unsigned char socket = 0; socket < SOCKET_SHADOWS; socket++)
+	{
+		wiznet_commit_socket(socket << 8);
+	}
+	unsigned char moved = Data_Moved;
+	Data_Moved = 0;
+	return moved;
+}
+
+static void wiznet_read_frames(unsigned short address, unsigned char *buffer, WiznetSink sink, unsigned short length)
+{
+	//reads a linear run of W5100 memory into the buffer, or hands it to sink a byte at a time
+	//the W5100 only accepts one data byte per 4 byte SPI frame, so each byte still costs a full frame,
+	//but the next frame byte is prepared while the current one is shifting out and SPDR is reloaded
+	//as soon as SPIF is set, which keeps the SPI clock running for as much of the frame as possible
+	//the address is kept as its two bytes, the msb only changes when the lsb wraps
+	//the callers count the frames, once per block rather than in the frame loop
+	
+	unsigned char addr_msb = address >> 8;
+	unsigned char addr_lsb = address & 0xFF;
+	unsigned char data = 0;
+	unsigned char have_data = 0;
+	while(length--)
+	{
+		WIZNET_SELECT();						//Chip select
+		WIZNET_SPI_WRITE(0x0F);				//read address command
+		if(have_data)
+		{
+			sink(data);						//the byte of the last frame, while the command shifts out
+		}
+		WIZNET_SPI_WAIT();
+		WIZNET_SPI_WRITE(addr_msb);			//send 16bit address, the replies are dummy data and are not read
+		WIZNET_SPI_WAIT();
+		WIZNET_SPI_WRITE(addr_lsb);
+		if(++addr_lsb == 0)					//work out the next address while the lsb shifts out
+		{
+			addr_msb++;
+		}
+		WIZNET_SPI_WAIT();
+		WIZNET_SPI_WRITE(0x00);				//0x00 is dummy data to drive the SPI clock
+		WIZNET_SPI_WAIT();
+		data = WIZNET_SPI_READ();			//read the byte
+		WIZNET_DESELECT();					//Chip deselect
+		if(sink)
+		{
+			have_data = 1;
+		}
+		else
+		{
+			*buffer++ = data;
+		}
+	}
+	if(have_data)
+	{
+		sink(data);
+	}
+}
+
+void wiznet_read_block(unsigned short address, unsigned char *buffer, unsigned short length)
+{
+	wiznet_counters.spi_frames += length;
+	wiznet_read_frames(address,buffer,NULL,length);
+}
+
+void wiznet_read_block_stateless(unsigned short address, unsigned char *buffer, unsigned short length)
+{
+	wiznet_read_frames(address,buffer,NULL,length);
+}
+
+static void wiznet_write_frames(unsigned short address, const unsigned char *data, WiznetSource source,
+								unsigned short length)
+{
+	//writes a linear run of W5100 memory from the data buffer, or from source a byte at a time,
+	//one 4 byte SPI frame per byte, see wiznet_read_frames for how the frames are kept back to back
 	
+	unsigned char addr_msb = address >> 8;
+	unsigned char addr_lsb = address & 0xFF;
+	unsigned char value = 0;
+	while(length--)
+	{
+		if(!source)
+		{
+			value = *data++;
+		}
+		
+		WIZNET_SELECT();						//Chip select
+		WIZNET_SPI_WRITE(0xF0);				//write address command
+		if(source)
+		{
+			value = source();					//the byte of this frame, while the command shifts out
+		}
+		WIZNET_SPI_WAIT();
+		WIZNET_SPI_WRITE(addr_msb);			//send 16bit address
+		WIZNET_SPI_WAIT();
+		WIZNET_SPI_WRITE(addr_lsb);
+		if(++addr_lsb == 0)
+		{
+			addr_msb++;
+		}
+		WIZNET_SPI_WAIT();
+		WIZNET_SPI_WRITE(value);				//send data byte
+		WIZNET_SPI_WAIT();
+		WIZNET_DESELECT();					//Chip deselect
+	}
+}
+
+void wiznet_write_block_stateless(unsigned short address, const unsigned char *data, unsigned short length)
+{
+	wiznet_write_frames(address,data,NULL,length);
+}
+
+void wiznet_write_block(unsigned short address, const unsigned char *data, unsigned short length)
+{
+	wiznet_counters.spi_frames += length;
+	wiznet_write_block_stateless(address,data,length);
+}
+
+static void wiznet_read_ring(unsigned short base, unsigned short mask, unsigned short pointer,
+							 unsigned char *buffer, WiznetSink sink, unsigned short length)
+{
+	//read from a socket ring buffer, the relative pointer is masked to the buffer size
+	//and the transfer is split into at most two linear runs where it wraps past the end of the buffer
+	unsigned short start = pointer & mask;
+	unsigned short first_run = (mask + 1) - start;	//bytes left before the end of the buffer
+	
+	wiznet_counters.spi_frames += length;
+	if(length <= first_run)
+	{
+		wiznet_read_frames(base + start, buffer, sink, length);
+	}
+	else
+	{
+		wiznet_read_frames(base + start, buffer, sink, first_run);
+		wiznet_read_frames(base, sink ? buffer : buffer + first_run, sink, length - first_run);	//wrap around to the start
+	}
+}
+
+static void wiznet_write_ring(unsigned short base, unsigned short mask, unsigned short pointer,
+							  const unsigned char *data, WiznetSource source, unsigned short length)
+{
+	//write to a socket ring buffer, split into at most two linear runs (see wiznet_read_ring)
+	unsigned short start = pointer & mask;
+	unsigned short first_run = (mask + 1) - start;
 	
-	//read the socket status register to check the status of the connection
-	unsigned char sock_status = wiznet_read_address(0x0403+socket);
+	wiznet_counters.spi_frames += length;
+	if(length <= first_run)
+	{
+		wiznet_write_frames(base + start, data, source, length);
+	}
+	else
+	{
+		wiznet_write_frames(base + start, data, source, first_run);
+		wiznet_write_frames(base, source ? data : data + first_run, source, length - first_run);
+	}
+}
+
+static void wiznet_send_data(const unsigned char* data, WiznetSource source, unsigned short data_size,unsigned short socket)
+{
+	//write the data at the shadowed write pointer, the real address is calculated from the relative
+	//write pointer and the sockets transmit buffer base and size (the socket offset is 0x0100 per socket)
+	WiznetShadow *shadow = wiznet_shadow(socket);
+	wiznet_write_ring(TX_BASE(socket), TX_MASK(socket), shadow->tx_wr, data, source, data_size);
+	
+	shadow->tx_wr += data_size;
+	shadow->tx_free -= data_size;
+	shadow->pending |= WIZNET_PENDING_SEND;		//sent by wiznet_commit
+	Data_Moved = 1;
+	wiznet_counters.tx_bytes += data_size;
+}
+
+unsigned short wiznet_send_tcp(unsigned char* data, unsigned short data_size,unsigned short socket)
+{
+	//returns the amount of bytes written to the W5100 chip
 	
-	if(sock_status != 23) //if socket is not open
+	if(wiznet_shadow(socket)->status != 23) //if socket is not open
 	{
 		//0 bytes written, cannot send data if there is no active connection
 		return 0;
 	}
 	
-	unsigned char msb = wiznet_read_address(0x0424+socket);
-	unsigned char lsb = wiznet_read_address(0x0425+socket);
-	unsigned short tx_wr_pt = ((msb & 0x00ff)<<8) + lsb; //find the location of the write pointer
-	
-	for(unsigned short i = 0 ; i< data_size;i++)
+	wiznet_send_data(data,NULL,data_size,socket);
+	return data_size;
+}
+
+unsigned short wiznet_send_tcp_source(WiznetSource source, unsigned short data_size, unsigned short socket)
+{
+	if(wiznet_shadow(socket)->status != 23)
 	{
-		//write the data, the real address is calculated from the relative write pointer
-		//0x4000 is the offset for the transmit buffers, and 0x07FF is the buffer size
-		//and the relative address with buffer size to cause writing to the buffer to wrap around
-		//if it exceeds the buffer size
-		unsigned short RelativeAddr = (tx_wr_pt+i) & 0x07FF; 
-		unsigned short SocketOffset = socket*8; //correct the offset for the selected socket
-		unsigned short realaddr = 0x4000 + SocketOffset + RelativeAddr; //base + socket + relative buffer address
-		wiznet_write_address(realaddr,data[i]);
+		return 0;
 	}
-	wiznet_write_address(0x0424+socket,((tx_wr_pt+data_size) & 0xFF00)>>8);
-	wiznet_write_address(0x0425+socket,(tx_wr_pt+data_size) & 0x00FF);
-	
-	wiznet_write_address(0x0401+socket,0x20); //Write CMD to transmit the data in the buffer and update the write pointer
 	
+	wiznet_send_data(NULL,source,data_size,socket);
 	return data_size;
 }
 
-void wiznet_receive_tcp(unsigned char *buffer, unsigned short read_amount, unsigned short Socket)
+static void wiznet_receive_data(unsigned char *buffer, WiznetSink sink, unsigned short read_amount, unsigned short Socket)
 {
 	//the Socket_offset variable is used to select which TCP socket is read
-
-	//get address of receive buffer read pointer
-	unsigned char msb = wiznet_read_address(0x0428+Socket);
-	unsigned char lsb = wiznet_read_address(0x0429+Socket);
-	unsigned short rx_re_pt = ((msb & 0x00ff)<<8) + lsb;			
+	WiznetShadow *shadow = wiznet_shadow(Socket);
 	
-	for(int i = 0 ; i<read_amount;i++)
-	{
-		//calculate the read address in the W5100 chip as the pointer only give a relative address
-		// 0x6000 is the receive buffers offset, 0x07FF is the receive buffer size
-		unsigned short RelativeAddr = (rx_re_pt+i) & 0x07FF;
-		unsigned short SocketOffset = Socket*8;
-		unsigned short realaddr = 0x6000 + SocketOffset + RelativeAddr;
-		
-		buffer[i] = wiznet_read_address(realaddr); //read byte into buffer and increment
-	}
+	//calculate the read address in the W5100 chip as the pointer only give a relative address
+	//using the sockets receive buffer base and size
+	wiznet_read_ring(RX_BASE(Socket), RX_MASK(Socket), shadow->rx_rd, buffer, sink, read_amount);
 	
-	wiznet_write_address(0x0428+Socket,((rx_re_pt+read_amount) & 0xFF00)>>8);	//set new pointer address (high and low byte)
-	wiznet_write_address(0x0429+Socket,(rx_re_pt+read_amount) & 0x00FF);
-	wiznet_write_address(0x0401+Socket,0x40);									//send received data cmd, (updates the receive buffer pointer)
+	shadow->rx_rd += read_amount;
+	shadow->rx_size -= read_amount;
+	shadow->pending |= WIZNET_PENDING_RECV;		//freed by wiznet_commit
+	Data_Moved = 1;
+	wiznet_counters.rx_bytes += read_amount;
 }
 
+void wiznet_receive_tcp(unsigned char *buffer, unsigned short read_amount, unsigned short Socket)
+{
+	wiznet_receive_data(buffer,NULL,read_amount,Socket);
+}
 
-
-
+void wiznet_receive_tcp_sink(WiznetSink sink, unsigned short read_amount, unsigned short Socket)
+{
+	wiznet_receive_data(NULL,sink,read_amount,Socket);
+}
@@ -2,20 +2,74 @@
 #ifndef WIZNET_H_
 #define WIZNET_H_
 
+//socket buffer sizes for wiznet_init, one per socket packed with WIZNET_MEM_LAYOUT
+//the 8KB of RX memory (and the 8KB of TX memory) is handed out in socket order, sockets that don't fit get none
+#define WIZNET_MEM_1KB 0x00
+#define WIZNET_MEM_2KB 0x01
+#define WIZNET_MEM_4KB 0x02
+#define WIZNET_MEM_8KB 0x03
+#define WIZNET_MEM_LAYOUT(sock0, sock1, sock2, sock3) ((sock0) | ((sock1) << 2) | ((sock2) << 4) | ((sock3) << 6))
+
+//2KB per socket, the W5100 reset default
+#define WIZNET_MEM_DEFAULT WIZNET_MEM_LAYOUT(WIZNET_MEM_2KB, WIZNET_MEM_2KB, WIZNET_MEM_2KB, WIZNET_MEM_2KB)
+//all 8KB to socket 0, the other sockets can't be used
+#define WIZNET_MEM_SOCKET0 WIZNET_MEM_LAYOUT(WIZNET_MEM_8KB, WIZNET_MEM_1KB, WIZNET_MEM_1KB, WIZNET_MEM_1KB)
+
+//Compile-time configuration, for a build that only ever uses one socket (see SMALL in the Makefile)
+//define WIZNET_SOCKET to the socket number and WIZNET_RX_LAYOUT and WIZNET_TX_LAYOUT to the layouts, then the
+//socket offset passed to every function is replaced by that socket, the layouts passed to wiznet_init are
+//ignored and the buffer bases and masks are constants, so the driver's address arithmetic folds away
+#ifdef WIZNET_SOCKET
+#if !defined(WIZNET_RX_LAYOUT) || !defined(WIZNET_TX_LAYOUT)
+#error "WIZNET_SOCKET needs WIZNET_RX_LAYOUT and WIZNET_TX_LAYOUT"
+#endif
+#endif
+
+//buffer size and offset from the start of the 8KB of buffer memory of a socket in a layout
+#define WIZNET_MEM_SIZE(layout, socket) (0x0400U << (((layout) >> ((socket)*2)) & 0x03))
+#define WIZNET_MEM_START(layout, socket) (((socket) > 0 ? WIZNET_MEM_SIZE(layout, 0) : 0) + \
+										  ((socket) > 1 ? WIZNET_MEM_SIZE(layout, 1) : 0) + \
+										  ((socket) > 2 ? WIZNET_MEM_SIZE(layout, 2) : 0))
+
 //setup for W5100, contains hardware specific settings
-void wiznet_init(void);
+//rx_layout and tx_layout set the socket buffer sizes (RMSR and TMSR registers), unless fixed by WIZNET_SOCKET
+void wiznet_init(unsigned char rx_layout, unsigned char tx_layout);
 
 //sets the network configuration on w5100
 void wiznet_set_config(const unsigned char gateway_ip[4], const unsigned char subnet_mask[4],
 const unsigned char mac_address[6], const unsigned char device_ip_address[4]);
 
 //setup a TCP listener socket, on one of the 4 w5100 sockets, which is selected by the socket offset
-//must specify a tcp port
+//must specify a tcp port, whatever the socket was doing before is closed
 void wiznet_socket_listen(unsigned short offset, unsigned short port);
 
-//get the size of the receive buffer (amount of data in the buffer) in bytes
+//close a socket and clear its interrupt flags, the socket status goes back to 0x00 (closed)
+void wiznet_socket_close(unsigned short offset);
+
+//read the socket status register (Sn_SR), 0x17 is an established TCP connection
+unsigned char wiznet_socket_status(unsigned short offset);
+
+//socket interrupt flags in Sn_IR
+#define WIZNET_IR_CON 0x01			//connection established
+#define WIZNET_IR_DISCON 0x02		//the peer closed the connection
+#define WIZNET_IR_RECV 0x04			//data received
+#define WIZNET_IR_TIMEOUT 0x08		//ARP or TCP retransmission timeout, the socket is closed
+#define WIZNET_IR_SEND_OK 0x10		//a SEND command has completed
+
+//drive the /INT pin for the sockets set in socket_mask (bit 0 is socket 0, IMR register)
+//INT stays low while any of those sockets has a flag set in Sn_IR
+void wiznet_interrupt_enable(unsigned char socket_mask);
+//read the sockets interrupt flags and clear the ones that were set
+unsigned char wiznet_socket_interrupts(unsigned short offset);
+//write back the buffer pointers of every TCP read and send since the last call, as one RECV and one SEND
+//command per socket (until then the data read stays in the receive buffer and the data sent is not sent)
+//returns 1 if data has been received or sent (on any socket) since the last call,
+//so the buffer sizes have changed even though the chip raised no interrupt for it
+unsigned char wiznet_commit(void);
+
+//get the size of the receive buffer (amount of data in the buffer) in bytes, as of the last commit
 unsigned short wiznet_Rx_size(unsigned short offset);
-//get the available size of the trasmit buffer in bytes
+//get the available size of the trasmit buffer in bytes, as of the last commit
 unsigned short wiznet_Tx_size(unsigned short offset);
 
 //returns 0 if there is no established connection to send data, or returns the amount of data sent
@@ -28,5 +82,41 @@ unsigned short wiznet_send_tcp(unsigned char* data, unsigned short data_size,uns
 //before a receive tcp function is run
 void wiznet_receive_tcp(unsigned char *buffer, unsigned short read_amount, unsigned short Socket_offset);
 
+//receive tcp data like wiznet_receive_tcp, but each byte is handed to sink instead of being stored in a buffer,
+//while the frame of the next byte is shifted out. The sink must not use the SPI bus
+typedef void (*WiznetSink)(unsigned char data);
+void wiznet_receive_tcp_sink(WiznetSink sink, unsigned short read_amount, unsigned short Socket_offset);
+
+//send tcp data like wiznet_send_tcp, but each byte is taken from source instead of a buffer, while the
+//command of its frame is shifted out. The source must not use the SPI bus
+typedef unsigned char (*WiznetSource)(void);
+unsigned short wiznet_send_tcp_source(WiznetSource source, unsigned short data_size, unsigned short offset);
+
+//transfer counters, for the boot loader's STAT command
+typedef struct
+{
+	unsigned long spi_frames;	//4 byte SPI frames, one per register or buffer byte
+	unsigned long rx_bytes;		//socket data read with wiznet_receive_tcp
+	unsigned long tx_bytes;		//socket data sent
+} WiznetCounters;
+extern WiznetCounters wiznet_counters;
+
+//block transfers to/from a linear run of W5100 memory (registers or buffer memory)
+//every byte still needs its own 4 byte SPI frame (command, address msb, address lsb, data)
+//so the ceiling is WIZNET_SPI_MAX_BYTES_PER_SEC payload bytes per second
+void wiznet_read_block(unsigned short address, unsigned char *buffer, unsigned short length);
+void wiznet_write_block(unsigned short address, const unsigned char *data, unsigned short length);
+
+//the same without counting, they touch none of the driver's variables, so an application can call them through
+//the boot loader's API (BootApi.h) without the boot loader writing to SRAM that is now the application's
+void wiznet_read_block_stateless(unsigned short address, unsigned char *buffer, unsigned short length);
+void wiznet_write_block_stateless(unsigned short address, const unsigned char *data, unsigned short length);
+
+//SPI clock is OSC/2 with SPI2X set (8MHz with the 16MHz external clock)
+//used to report achieved SPI throughput against the theoretical limit
+#define WIZNET_SPI_CLOCK_HZ 8000000UL
+#define WIZNET_SPI_FRAME_BYTES 4
+#define WIZNET_SPI_MAX_BYTES_PER_SEC (WIZNET_SPI_CLOCK_HZ / 8 / WIZNET_SPI_FRAME_BYTES)
+
 
 #endif /* WIZNET_H_ */
\ No newline at end of file